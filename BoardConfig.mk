@@ -127,9 +127,15 @@ BOARD_CHARGER_SHOW_PERCENTAGE := true
 BOARD_HAL_STATIC_LIBRARIES += libhealthd.pisces
 BOARD_RTC_WAKEALARM_PATH := /sys/class/rtc/rtc0/wakealarm
 BOARD_HEALTHD_CUSTOM_CHARGER_RES := $(LOCAL_PATH)/libhealthd/images
+CHARGER_RAW_PATH         := /res/images/charger
 BACKLIGHT_PATH           := /sys/class/backlight/lm3533-backlight0/brightness
 SECONDARY_BACKLIGHT_PATH := /sys/class/backlight/lm3533-backlight1/brightness
 
+# Lights
+# only once the red, green and blue LED driver is known to implement
+# blink_set, until then flashing LED states are shown solid
+#BOARD_LIGHTS_HW_BLINK := true
+
 # Graphics
 USE_OPENGL_RENDERER := true
 VSYNC_EVENT_PHASE_OFFSET_NS := 7500000
@@ -51,7 +51,12 @@ public class VibratorHW {
      */
 
     public static boolean setIntensity(int intensity)  {
-        SystemProperties.set("persist.vibrator_intensity", Long.toString(intensity));
+        /* the HAL only reparses this when the property serial changes */
+        intensity = Math.max(getMinIntensity(), Math.min(getMaxIntensity(), intensity));
+        if (intensity == getCurIntensity()) {
+            return true;
+        }
+        SystemProperties.set("persist.vibrator_intensity", Integer.toString(intensity));
         return true;
     }
 
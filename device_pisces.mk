@@ -160,6 +160,8 @@ PRODUCT_PACKAGES += \
 # Charger
 PRODUCT_PACKAGES += \
     charger_res_images \
+    pisces_charger_battery_scale \
+    pisces_charger_battery_fail \
 
 # QuickBoot
 PRODUCT_PACKAGES += \
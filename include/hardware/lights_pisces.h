@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2015 Xuefer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_LIGHTS_PISCES_INTERFACE_H
+#define ANDROID_LIGHTS_PISCES_INTERFACE_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/lights.h>
+
+__BEGIN_DECLS
+
+/*
+ * lights.pisces extensions
+ *
+ * a device opened from lights.pisces reports this version in
+ * common.version, only then it is safe to cast the light_device_t
+ * to pisces_light_device_t
+ */
+#define PISCES_LIGHTS_DEVICE_API_VERSION_1_1 HARDWARE_DEVICE_API_VERSION(1,1)
+#define PISCES_LIGHTS_DEVICE_API_VERSION_1_2 HARDWARE_DEVICE_API_VERSION(1,2)
+#define PISCES_LIGHTS_DEVICE_API_VERSION_1_3 HARDWARE_DEVICE_API_VERSION(1,3)
+#define PISCES_LIGHTS_DEVICE_API_VERSION PISCES_LIGHTS_DEVICE_API_VERSION_1_3
+
+/* effects for set_led_effect */
+enum {
+    PISCES_LIGHT_EFFECT_NONE = 0,
+    /* fade the color in and out */
+    PISCES_LIGHT_EFFECT_BREATHE = 1,
+    /* quick rise, then decay */
+    PISCES_LIGHT_EFFECT_PULSE = 2,
+    /* breathe through the colors of every lit LED light */
+    PISCES_LIGHT_EFFECT_CYCLE = 3,
+};
+
+typedef struct pisces_light_device {
+    struct light_device_t common;
+
+    /*
+     * Write set_light calls, sysfs updates and the syscalls they took
+     * for every light type to fd as text
+     */
+    int (*dump)(struct pisces_light_device* dev, int fd);
+
+    /* everything below is only there from PISCES_LIGHTS_DEVICE_API_VERSION_1_2 */
+
+    /*
+     * Let the HAL switch the button backlight off after timeout_ms
+     * without user_activity, and back on at the next activity. The
+     * brightness set through set_light on the buttons light is then
+     * used for the lit keys, 0 keeps them off. 0 hands the keys back
+     * to set_light alone.
+     *
+     * Return 0 on success, -EINVAL on a negative timeout, -ENODEV if
+     * the HAL has no timer to run it
+     */
+    int (*set_button_timeout)(struct pisces_light_device* dev, int timeout_ms);
+
+    /*
+     * Report user input. Cheap enough to call on every touch, it only
+     * touches sysfs when the keys have to be switched back on
+     */
+    int (*user_activity)(struct pisces_light_device* dev);
+
+    /* everything below is only there from PISCES_LIGHTS_DEVICE_API_VERSION_1_3 */
+
+    /*
+     * Draw whatever the LED shows with a PISCES_LIGHT_EFFECT_*, one
+     * cycle every period_ms, clamped to 500 - 10000. It replaces the
+     * flash mode of the attention, notifications and battery lights
+     * until PISCES_LIGHT_EFFECT_NONE hands the LED back to them.
+     *
+     * The HAL draws the frames from a timer, the CPU wakes up about 30
+     * times a second while the LED is lit, and the effect freezes while
+     * the device sleeps.
+     *
+     * Return 0 on success, -EINVAL on an unknown effect, -ENODEV if the
+     * HAL has no timer to run it
+     */
+    int (*set_led_effect)(struct pisces_light_device* dev, int effect, int period_ms);
+} pisces_light_device_t;
+
+__END_DECLS
+
+#endif  // ANDROID_LIGHTS_PISCES_INTERFACE_H
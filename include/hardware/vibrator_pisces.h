@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2014 Xuefer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VIBRATOR_PISCES_INTERFACE_H
+#define ANDROID_VIBRATOR_PISCES_INTERFACE_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/vibrator.h>
+
+__BEGIN_DECLS
+
+/*
+ * vibrator.pisces extensions
+ *
+ * a device opened from vibrator.pisces reports this version in
+ * common.version, only then it is safe to cast the vibrator_device_t
+ * to pisces_vibrator_device_t
+ */
+#define PISCES_VIBRATOR_DEVICE_API_VERSION HARDWARE_DEVICE_API_VERSION(1,1)
+
+#define PISCES_VIBRATOR_MAX_SEGMENTS  64
+#define PISCES_VIBRATOR_MAX_AMPLITUDE 255
+
+/* effects from the IVT effect library */
+enum {
+    PISCES_VIBRATOR_EFFECT_CLICK,
+    PISCES_VIBRATOR_EFFECT_DOUBLE_CLICK,
+    PISCES_VIBRATOR_EFFECT_TICK,
+    PISCES_VIBRATOR_EFFECT_LONG_PRESS,
+    PISCES_VIBRATOR_EFFECT_COUNT,
+};
+
+typedef struct pisces_vibrator_segment {
+    /* how long this segment lasts */
+    uint32_t duration_ms;
+    /* 0 is off, PISCES_VIBRATOR_MAX_AMPLITUDE is the user intensity */
+    uint32_t amplitude;
+} pisces_vibrator_segment_t;
+
+typedef struct pisces_vibrator_device {
+    vibrator_device_t common;
+
+    /*
+     * Play a whole pattern timed by the HAL, replacing whatever is
+     * playing. repeat is the index of the segment to loop back to
+     * after the last one, or -1 to play the pattern once.
+     * vibrator_on/vibrator_off stop the pattern.
+     *
+     * Return 0 if the pattern was queued, -EINVAL on bad arguments,
+     * -EAGAIN while the ImmVibe service is unreachable
+     */
+    int (*play_pattern)(struct pisces_vibrator_device* vibradev,
+            const pisces_vibrator_segment_t* segments, unsigned int count, int repeat);
+
+    /*
+     * Play one of the PISCES_VIBRATOR_EFFECT_* effects, replacing
+     * whatever is playing.
+     *
+     * Return 0 if the effect was queued, -ENOTSUP if the effect library
+     * does not have it, -EAGAIN while the ImmVibe service is unreachable
+     */
+    int (*play_effect)(struct pisces_vibrator_device* vibradev, int effect);
+
+    /*
+     * Write the ImmVibe connection state and request, drop, failure and
+     * reconnect counters to fd as text
+     */
+    int (*dump)(struct pisces_vibrator_device* vibradev, int fd);
+} pisces_vibrator_device_t;
+
+__END_DECLS
+
+#endif  // ANDROID_VIBRATOR_PISCES_INTERFACE_H
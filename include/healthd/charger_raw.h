@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2015 Xuefer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PISCES_CHARGER_RAW_H
+#define PISCES_CHARGER_RAW_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * pre-decoded charger images
+ *
+ * the header, then from data_offset the frames as spans of pixels in
+ * the framebuffer format. the first frame starts filled with
+ * background, every other one as a copy of the frame before it, and
+ * its spans are copied over that. the animation frames only differ
+ * in a few rows, so charger mode builds them with memcpy alone and
+ * the file stays a fraction of the decoded size.
+ *
+ * a frame is a uint32_t span count, then the spans: a
+ * charger_raw_span and its count pixels. all fields are little
+ * endian, like the device
+ */
+#define CHARGER_RAW_MAGIC   0x57524843 /* "CHRW" */
+#define CHARGER_RAW_VERSION 2
+
+/* R, G, B, then a byte of 0xff, what minui draws with RECOVERY_RGBX */
+#define CHARGER_RAW_FORMAT_RGBX_8888 1
+
+struct charger_raw_header {
+    uint32_t magic;
+    uint32_t version;
+    /* CHARGER_RAW_FORMAT_* */
+    uint32_t format;
+    uint32_t pixel_bytes;
+    /* of one frame */
+    uint32_t width;
+    uint32_t height;
+    uint32_t frames;
+    /* the pixel the first frame starts from */
+    uint32_t background;
+    /* of the first frame, from the start of the file */
+    uint32_t data_offset;
+    /* of all frames */
+    uint32_t data_size;
+    uint32_t reserved[6];
+};
+
+struct charger_raw_span {
+    uint16_t y;
+    uint16_t x;
+    uint32_t count;
+};
+
+__END_DECLS
+
+#endif  // PISCES_CHARGER_RAW_H
@@ -24,3 +24,47 @@ LOCAL_MODULE := libhealthd.pisces
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := battery_history_csv.c
+
+LOCAL_MODULE := battery_history_csv
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := charger_raw.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include external/libpng external/zlib
+
+LOCAL_STATIC_LIBRARIES := libpng libz
+
+LOCAL_MODULE := charger_raw
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+CHARGER_RAW := $(LOCAL_INSTALLED_MODULE)
+
+# the charger images decoded at build time, next to the pngs in
+# /res/images/charger. healthd reads them from CHARGER_RAW_PATH
+define _add-charger-raw-image
+include $$(CLEAR_VARS)
+LOCAL_MODULE := pisces_charger_$(1)
+LOCAL_MODULE_STEM := $(1).raw
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_PATH := $$(TARGET_ROOT_OUT)/res/images/charger
+include $$(BUILD_SYSTEM)/base_rules.mk
+$$(LOCAL_BUILT_MODULE): $$(LOCAL_PATH)/images/$(1).png $$(CHARGER_RAW)
+	@mkdir -p $$(dir $$@)
+	$$(hide) $$(CHARGER_RAW) $$< $$@
+endef
+
+$(foreach _img,battery_scale battery_fail, \
+  $(eval $(call _add-charger-raw-image,$(_img))))
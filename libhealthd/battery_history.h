@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2015 Xuefer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PISCES_BATTERY_HISTORY_H
+#define PISCES_BATTERY_HISTORY_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * battery history ring
+ *
+ * a fixed size file written by healthd: the header, then
+ * BATTERY_HISTORY_ENTRIES entries. head is the slot the next entry
+ * goes to, count how many slots hold one. the oldest entry is at
+ * head - count, modulo the ring size. all fields are little endian,
+ * like the device
+ */
+#define BATTERY_HISTORY_PATH    "/data/misc/healthd/battery_history"
+#define BATTERY_HISTORY_MAGIC   0x48544142 /* "BATH" */
+#define BATTERY_HISTORY_VERSION 1
+#define BATTERY_HISTORY_ENTRIES 4096
+
+#define BATTERY_HISTORY_CHARGER_AC       (1 << 0)
+#define BATTERY_HISTORY_CHARGER_USB      (1 << 1)
+#define BATTERY_HISTORY_CHARGER_WIRELESS (1 << 2)
+/* the first entry healthd wrote after it started */
+#define BATTERY_HISTORY_BOOT             (1 << 7)
+
+struct battery_history_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t entries;
+    uint32_t head;
+    uint32_t count;
+    uint32_t reserved[10];
+};
+
+struct battery_history_entry {
+    /* wall clock, seconds since the epoch */
+    uint32_t time;
+    /* -1 when the fuel gauge has no current_now */
+    int32_t current_now_ua;
+    uint16_t voltage_mv;
+    /* tenths of a degree celsius */
+    int16_t temperature;
+    /* percent */
+    uint8_t level;
+    /* BATTERY_HISTORY_* */
+    uint8_t flags;
+    uint16_t reserved;
+};
+
+#define BATTERY_HISTORY_SIZE (sizeof(struct battery_history_header) + \
+        BATTERY_HISTORY_ENTRIES * sizeof(struct battery_history_entry))
+
+__END_DECLS
+
+#endif  // PISCES_BATTERY_HISTORY_H
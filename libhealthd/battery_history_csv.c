@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2015 Xuefer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * battery_history_csv <battery_history>
+ *
+ * print a battery history ring pulled from the device, oldest first,
+ * as CSV on stdout:
+ *   adb pull /data/misc/healthd/battery_history
+ *   battery_history_csv battery_history > history.csv
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "battery_history.h"
+
+static const char *charger_name(unsigned int flags)
+{
+	if (flags & BATTERY_HISTORY_CHARGER_AC)
+		return "ac";
+	if (flags & BATTERY_HISTORY_CHARGER_USB)
+		return "usb";
+	if (flags & BATTERY_HISTORY_CHARGER_WIRELESS)
+		return "wireless";
+	return "none";
+}
+
+int main(int argc, char **argv)
+{
+	struct battery_history_header hdr;
+	struct battery_history_entry *ring;
+	unsigned int i, slot;
+	char when[32];
+	FILE *f;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <battery_history>\n", argv[0]);
+		return 2;
+	}
+
+	f = fopen(argv[1], "rb");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+		hdr.magic != BATTERY_HISTORY_MAGIC ||
+		hdr.version != BATTERY_HISTORY_VERSION ||
+		hdr.entry_size != sizeof(struct battery_history_entry) ||
+		hdr.entries == 0 || hdr.head >= hdr.entries || hdr.count > hdr.entries) {
+		fprintf(stderr, "%s: not a battery history\n", argv[1]);
+		fclose(f);
+		return 1;
+	}
+
+	ring = calloc(hdr.entries, sizeof(*ring));
+	if (!ring || fread(ring, sizeof(*ring), hdr.entries, f) != hdr.entries) {
+		fprintf(stderr, "%s: truncated\n", argv[1]);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+
+	printf("time,utc,level,voltage_mv,current_ua,temperature_c,charger,boot\n");
+	for (i = 0; i < hdr.count; i++) {
+		struct battery_history_entry *e;
+		time_t t;
+
+		slot = (hdr.head + hdr.entries - hdr.count + i) % hdr.entries;
+		e = &ring[slot];
+		t = e->time;
+		strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+		printf("%u,%s,%u,%u,%d,%.1f,%s,%d\n", e->time, when, e->level,
+				e->voltage_mv, e->current_now_ua, e->temperature / 10.0,
+				charger_name(e->flags), !!(e->flags & BATTERY_HISTORY_BOOT));
+	}
+
+	free(ring);
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2015 Xuefer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PISCES_BATTERY_SNAPSHOT_H
+#define PISCES_BATTERY_SNAPSHOT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/cdefs.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+__BEGIN_DECLS
+
+/*
+ * healthd publishes every battery update here, readers map the file
+ * read-only and poll it without any IPC
+ *
+ * the writer makes seq odd, updates the fields and makes it even
+ * again. a reader copies the snapshot between two reads of an even,
+ * unchanged seq, battery_snapshot_read does exactly that
+ */
+#define BATTERY_SNAPSHOT_PATH    "/dev/battery_snapshot"
+#define BATTERY_SNAPSHOT_MAGIC   0x53544142 /* "BATS" */
+#define BATTERY_SNAPSHOT_VERSION 2
+
+#define BATTERY_SNAPSHOT_PRESENT          (1 << 0)
+#define BATTERY_SNAPSHOT_CHARGER_AC       (1 << 1)
+#define BATTERY_SNAPSHOT_CHARGER_USB      (1 << 2)
+#define BATTERY_SNAPSHOT_CHARGER_WIRELESS (1 << 3)
+
+struct battery_snapshot {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    /* BATTERY_SNAPSHOT_* */
+    uint32_t flags;
+    /* CLOCK_BOOTTIME of the update */
+    int64_t timestamp_ns;
+    /* percent */
+    int32_t level;
+    int32_t voltage_mv;
+    /* -1 when the fuel gauge has no such node */
+    int32_t current_now_ua;
+    int32_t charge_counter_uah;
+    /* tenths of a degree celsius */
+    int32_t temperature;
+    /* BATTERY_STATUS_* and BATTERY_HEALTH_* of batteryservice */
+    int32_t status;
+    int32_t health;
+    /* from version 2, estimated seconds, -1 when there is no estimate */
+    int32_t time_to_full_s;
+    int32_t time_to_empty_s;
+    int32_t reserved;
+};
+
+/* map the snapshot read-only, NULL with errno set if healthd has none */
+static inline const struct battery_snapshot *battery_snapshot_open(void)
+{
+    const struct battery_snapshot *shm;
+    int fd = open(BATTERY_SNAPSHOT_PATH, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+    shm = (const struct battery_snapshot *) mmap(NULL, sizeof(*shm), PROT_READ,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+    if (shm->magic != BATTERY_SNAPSHOT_MAGIC) {
+        munmap((void *) shm, sizeof(*shm));
+        errno = EINVAL;
+        return NULL;
+    }
+    return shm;
+}
+
+static inline void battery_snapshot_close(const struct battery_snapshot *shm)
+{
+    munmap((void *) shm, sizeof(*shm));
+}
+
+/*
+ * copy a consistent snapshot to out. returns 0, or -EAGAIN if healthd
+ * kept writing for every retry, which only a stuck writer does
+ */
+static inline int battery_snapshot_read(const struct battery_snapshot *shm,
+        struct battery_snapshot *out)
+{
+    uint32_t seq;
+    int retry;
+
+    for (retry = 0; retry < 1000; retry++) {
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(out, shm, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+    return -EAGAIN;
+}
+
+__END_DECLS
+
+#endif  // PISCES_BATTERY_SNAPSHOT_H
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2015 Xuefer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * charger_raw <image.png> <image.raw>
+ *
+ * decode a charger image at build time into the RGBX_8888 frame spans
+ * of healthd/charger_raw.h. a "Frames" text chunk splits the png into
+ * frames with interlaced rows, the way minui reads battery_scale.png:
+ * row y belongs to frame y % frames. every row that differs from the
+ * frame before it gets one span, from its first changed pixel to its
+ * last
+ */
+
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <healthd/charger_raw.h>
+
+struct encoder {
+	unsigned char *data;
+	size_t size, alloc;
+};
+
+static int put(struct encoder *enc, const void *data, size_t size)
+{
+	if (enc->size + size > enc->alloc) {
+		size_t alloc = enc->alloc ? enc->alloc : 65536;
+		unsigned char *p;
+
+		while (alloc < enc->size + size)
+			alloc *= 2;
+		p = realloc(enc->data, alloc);
+		if (!p)
+			return -1;
+		enc->data = p;
+		enc->alloc = alloc;
+	}
+	memcpy(enc->data + enc->size, data, size);
+	enc->size += size;
+	return 0;
+}
+
+/* spans of frame that differ from prev, rows of width pixels */
+static int put_frame(struct encoder *enc, const uint32_t *prev,
+		const uint32_t *frame, unsigned int width, unsigned int height)
+{
+	struct charger_raw_span span;
+	size_t count_at = enc->size;
+	uint32_t spans = 0;
+	unsigned int y, first, last;
+
+	if (put(enc, &spans, sizeof(spans)))
+		return -1;
+	for (y = 0; y < height; y++, prev += width, frame += width) {
+		for (first = 0; first < width && frame[first] == prev[first]; first++)
+			;
+		if (first == width)
+			continue;
+		for (last = width - 1; frame[last] == prev[last]; last--)
+			;
+		span.y = y;
+		span.x = first;
+		span.count = last - first + 1;
+		if (put(enc, &span, sizeof(span)) ||
+			put(enc, frame + first, span.count * 4))
+			return -1;
+		spans++;
+	}
+	memcpy(enc->data + count_at, &spans, sizeof(spans));
+	return 0;
+}
+
+static unsigned int png_frames(png_structp png, png_infop info)
+{
+	png_textp text;
+	int i, count;
+
+	count = png_get_text(png, info, &text, NULL);
+	for (i = 0; i < count; i++)
+		if (!strcmp(text[i].key, "Frames"))
+			return atoi(text[i].text);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct charger_raw_header hdr;
+	png_structp png = NULL;
+	png_infop info = NULL;
+	/* set after the setjmp, so they have to survive a png error */
+	uint32_t *volatile strip = NULL, *volatile background = NULL;
+	unsigned char *volatile row = NULL;
+	struct encoder enc = { NULL, 0, 0 };
+	FILE *volatile out = NULL;
+	unsigned int i, y, frames, frame_pixels, row_bytes;
+	png_uint_32 width, height;
+	FILE *in;
+	int ret = 1;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <image.png> <image.raw>\n", argv[0]);
+		return 2;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png)
+		info = png_create_info_struct(png);
+	if (!info) {
+		fprintf(stderr, "%s: out of memory\n", argv[1]);
+		goto out;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		fprintf(stderr, "%s: not a png\n", argv[1]);
+		goto out;
+	}
+
+	png_init_io(png, in);
+	png_read_info(png, info);
+	width = png_get_image_width(png, info);
+	height = png_get_image_height(png, info);
+
+	/* whatever the png holds, rows come out as RGBX */
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_gray_to_rgb(png);
+	png_set_strip_alpha(png);
+	png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+	if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+		fprintf(stderr, "%s: interlaced pngs are not supported\n", argv[1]);
+		goto out;
+	}
+	png_read_update_info(png, info);
+
+	frames = png_frames(png, info);
+	if (frames == 0 || height % frames) {
+		fprintf(stderr, "%s: %u rows do not split into %u frames\n", argv[1],
+				(unsigned int) height, frames);
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CHARGER_RAW_MAGIC;
+	hdr.version = CHARGER_RAW_VERSION;
+	hdr.format = CHARGER_RAW_FORMAT_RGBX_8888;
+	hdr.pixel_bytes = 4;
+	hdr.width = width;
+	hdr.height = height / frames;
+	hdr.frames = frames;
+	hdr.data_offset = sizeof(hdr);
+	row_bytes = width * 4;
+	frame_pixels = hdr.height * width;
+
+	if (width > 65535 || hdr.height > 65535) {
+		fprintf(stderr, "%s: %ux%u is too large\n", argv[1],
+				(unsigned int) width, hdr.height);
+		goto out;
+	}
+	strip = malloc((size_t) frames * frame_pixels * 4);
+	background = malloc((size_t) frame_pixels * 4);
+	row = malloc(row_bytes);
+	if (!strip || !background || !row) {
+		fprintf(stderr, "%s: out of memory\n", argv[1]);
+		goto out;
+	}
+	for (y = 0; y < height; y++) {
+		png_read_row(png, row, NULL);
+		memcpy(strip + (y % frames) * frame_pixels + (y / frames) * width,
+				row, row_bytes);
+	}
+
+	/* the first frame is drawn over its own top left pixel */
+	hdr.background = strip[0];
+	for (i = 0; i < frame_pixels; i++)
+		background[i] = hdr.background;
+	for (i = 0; i < frames; i++)
+		if (put_frame(&enc, i ? strip + (i - 1) * frame_pixels : background,
+				strip + i * frame_pixels, width, hdr.height)) {
+			fprintf(stderr, "%s: out of memory\n", argv[1]);
+			goto out;
+		}
+	hdr.data_size = enc.size;
+
+	out = fopen(argv[2], "wb");
+	if (!out) {
+		perror(argv[2]);
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+		fwrite(enc.data, 1, enc.size, out) != enc.size ||
+		fclose(out)) {
+		out = NULL;
+		fprintf(stderr, "%s: write failed\n", argv[2]);
+		remove(argv[2]);
+		goto out;
+	}
+	out = NULL;
+	ret = 0;
+
+out:
+	if (out)
+		fclose(out);
+	png_destroy_read_struct(&png, &info, NULL);
+	fclose(in);
+	free(enc.data);
+	free(row);
+	free(background);
+	free(strip);
+	return ret;
+}
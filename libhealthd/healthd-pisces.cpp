@@ -14,12 +14,18 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -36,6 +42,9 @@
 
 #include <healthd.h>
 
+#include "battery_history.h"
+#include "battery_snapshot.h"
+
 #define LOGE(x...) do { KLOG_ERROR("charger", x); } while (0)
 #define LOGI(x...) do { KLOG_INFO("charger", x); } while (0)
 #define LOGV(x...) do { KLOG_DEBUG("charger", x); } while (0)
@@ -45,6 +54,10 @@ enum alarm_time_type {
 	RTC_TIME,
 };
 
+#ifndef CLOCK_BOOTTIME_ALARM
+#define CLOCK_BOOTTIME_ALARM 9
+#endif
+
 #define RTC_WAKEALARM_PATH "/sys/class/rtc/rtc0/wakealarm"
 #define RTC_EPOCH_PATH     "/sys/class/rtc/rtc0/since_epoch"
 
@@ -54,92 +67,98 @@ enum alarm_time_type {
  */
 static time_t alm_secs;
 
+/*
+ * both nodes are opened once and re-read
+ * with pread, indexed by alarm_time_type
+ */
+static const char *const rtc_paths[] = {
+	RTC_WAKEALARM_PATH,
+	RTC_EPOCH_PATH,
+};
+static int rtc_fds[] = { -1, -1 };
+
+/*
+ * rtc time minus boottime, taken once when
+ * the alarm thread starts. boottime keeps
+ * counting in suspend, so rtc time is this
+ * plus boottime without reading the rtc
+ */
+static time_t rtc_boottime_offset;
+
+static time_t boottime_secs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ts.tv_sec;
+}
+
 static int alarm_get_time(enum alarm_time_type time_type,
 						  time_t *secs)
 {
 	char buf[80];
 	char *end;
-	struct tm tm;
-	unsigned int cmd;
-	int rc, fd = -1;
-	const char *path;
+	int rc, fd;
 
 	if (!secs)
 		return -1;
 
-	switch (time_type) {
-	case ALARM_TIME:
-		path = RTC_WAKEALARM_PATH;
-		break;
-
-	case RTC_TIME:
-		path = RTC_EPOCH_PATH;
-		break;
-
-	default:
+	if (time_type != ALARM_TIME && time_type != RTC_TIME) {
 		LOGE("Invalid time type\n");
 		return -1;
 	}
 
-	fd = open(path, O_RDWR);
+	fd = rtc_fds[time_type];
 	if (fd < 0) {
-		LOGE("Can't open path %s: %s\n", path, strerror_r(errno, buf, sizeof(buf)));
-		return -1;
+		fd = open(rtc_paths[time_type], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			LOGE("Can't open path %s: %s\n", rtc_paths[time_type],
+				 strerror_r(errno, buf, sizeof(buf)));
+			return -1;
+		}
+		rtc_fds[time_type] = fd;
 	}
 
-	rc = read(fd, buf, sizeof(buf));
+	rc = pread(fd, buf, sizeof(buf) - 1, 0);
 	if (rc < 0) {
 		LOGE("Unable to get time\n");
-		goto err;
+		return -1;
 	}
-	end = buf + rc;
+	buf[rc] = '\0';
 
 	errno = 0;
 	*secs = strtol(buf, &end, 10);
 	if (errno != 0) {
 		LOGE("Invalid seconds = %ld: %s\n", *secs, strerror_r(errno, buf, sizeof(buf)));
-		goto err;
+		return -1;
 	}
 
-	close(fd);
 	return 0;
-
-err:
-	close(fd);
-	return -1;
 }
 
 #define ERR_SECS 2
-static int alarm_is_alm_expired()
-{
-	int rc;
-	time_t rtc_secs;
 
-	rc = alarm_get_time(RTC_TIME, &rtc_secs);
-	if (rc < 0)
-		return 0;
-
-	return (alm_secs >= rtc_secs - ERR_SECS &&
-			alm_secs <= rtc_secs + ERR_SECS) ? 1 : 0;
+/*
+ * seconds left until the alarm. a wake may
+ * come well after it, so callers take
+ * anything up to ERR_SECS as expired
+ */
+static time_t alarm_remaining_secs()
+{
+	return alm_secs - (boottime_secs() + rtc_boottime_offset);
 }
 
-static int alarm_set_reboot_time_and_wait(time_t secs)
+static int alarm_set(int fd, time_t secs)
 {
-	int rc, fd;
 	struct timespec ts;
-
-	fd = open("/dev/alarm", O_RDWR);
-	if (fd < 0) {
-		LOGE("Can't open alarm devfs node\n");
-		goto err;
-	}
+	int rc;
 
 	/* get the elapsed realtime from boot time to now */
 	rc = ioctl(fd, ANDROID_ALARM_GET_TIME(
 					  ANDROID_ALARM_ELAPSED_REALTIME_WAKEUP), &ts);
 	if (rc < 0) {
 		LOGE("Unable to get elapsed realtime\n");
-		goto err;
+		return -1;
 	}
 
 	/* calculate the elapsed time from boot time to reboot time */
@@ -150,16 +169,40 @@ static int alarm_set_reboot_time_and_wait(time_t secs)
 					  ANDROID_ALARM_ELAPSED_REALTIME_WAKEUP), &ts);
 	if (rc < 0) {
 		LOGE("Unable to set reboot time to %ld\n", secs);
-		goto err;
+		return -1;
 	}
+	return 0;
+}
 
-	do {
-		rc = ioctl(fd, ANDROID_ALARM_WAIT);
-	} while ((rc < 0 && errno == EINTR) || !alarm_is_alm_expired());
+static int alarm_set_reboot_time_and_wait(time_t secs)
+{
+	int rc, fd;
+
+	fd = open("/dev/alarm", O_RDWR);
+	if (fd < 0) {
+		LOGE("Can't open alarm devfs node\n");
+		goto err;
+	}
 
-	if (rc <= 0) {
-		LOGE("Unable to wait on alarm\n");
+	if (alarm_set(fd, secs) < 0)
 		goto err;
+
+	for (;;) {
+		rc = ioctl(fd, ANDROID_ALARM_WAIT);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0) {
+			LOGE("Unable to wait on alarm\n");
+			goto err;
+		}
+
+		secs = alarm_remaining_secs();
+		if (secs <= ERR_SECS)
+			break;
+
+		/* early, the alarm is spent, set it again for the rest */
+		if (alarm_set(fd, secs) < 0)
+			goto err;
 	}
 
 	close(fd);
@@ -171,7 +214,13 @@ err:
 	return -1;
 }
 
-static void *alarm_thread(void *)
+/*
+ * read the alarm register and the rtc and
+ * return in how many seconds the phone
+ * should reboot, or -1 if there is no
+ * power off alarm pending
+ */
+static time_t alarm_get_reboot_secs()
 {
 	time_t rtc_secs, rb_secs;
 	int rc;
@@ -185,55 +234,692 @@ static void *alarm_thread(void *)
 	 */
 	rc = alarm_get_time(ALARM_TIME, &alm_secs);
 	if (rc < 0 || !alm_secs)
-		goto err;
+		return -1;
 
 	rc = alarm_get_time(RTC_TIME, &rtc_secs);
 	if (rc < 0)
-		goto err;
+		return -1;
+	rtc_boottime_offset = rtc_secs - boottime_secs();
 
 	/*
 	 * calculate the reboot time after which
 	 * the phone will reboot
 	 */
 	rb_secs = alm_secs - rtc_secs;
-	if (rb_secs <= 0)
-		goto err;
-
-	rc = alarm_set_reboot_time_and_wait(rb_secs);
-	if (rc < 0)
-		goto err;
+	return rb_secs > 0 ? rb_secs : -1;
+}
 
+static void alarm_reboot()
+{
 	LOGI("Exit from power off charging, reboot the phone!\n");
 	android_reboot(ANDROID_RB_RESTART2, 0, (char *)"rtc");
+}
+
+static void *alarm_thread(void *arg)
+{
+	time_t rb_secs = (time_t)(intptr_t)arg;
+	int rc;
+
+	rc = alarm_set_reboot_time_and_wait(rb_secs);
+	if (rc == 0)
+		alarm_reboot();
 
-err:
 	LOGE("Exit from alarm thread\n");
 	return NULL;
 }
 
+/*
+ * with alarm timers the reboot time is a
+ * timerfd in healthd's own epoll loop, no
+ * thread sits in /dev/alarm. healthd sets
+ * EPOLLWAKEUP on it, so the wake holds a
+ * wakeup source until the handler ran
+ */
+static int alarm_timer_fd = -1;
+
+static void alarm_timer_event(uint32_t)
+{
+	uint64_t expirations;
+	struct itimerspec its;
+	time_t remaining;
+
+	if (read(alarm_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	remaining = alarm_remaining_secs();
+	if (remaining <= ERR_SECS) {
+		alarm_reboot();
+		return;
+	}
+
+	/* early, go back to sleep until the alarm is due */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = remaining;
+	timerfd_settime(alarm_timer_fd, 0, &its, NULL);
+}
+
+static int alarm_timer_init(time_t rb_secs)
+{
+	struct itimerspec its;
+	char buf[80];
+
+	alarm_timer_fd = timerfd_create(CLOCK_BOOTTIME_ALARM, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (alarm_timer_fd < 0) {
+		LOGI("No alarm timers (%s), using /dev/alarm\n",
+			 strerror_r(errno, buf, sizeof(buf)));
+		return -1;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = rb_secs;
+	if (timerfd_settime(alarm_timer_fd, 0, &its, NULL) < 0 ||
+		healthd_register_event(alarm_timer_fd, alarm_timer_event) < 0) {
+		LOGE("Unable to set reboot timer: %s\n", strerror_r(errno, buf, sizeof(buf)));
+		close(alarm_timer_fd);
+		alarm_timer_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
 static void power_off_alarm_init()
 {
 	pthread_t tid;
+	time_t rb_secs;
 	int rc;
 	char value[PROP_VALUE_MAX];
 
 	property_get("ro.bootmode", value, "");
-	if (!strcmp("charger", value)) {
-		rc = pthread_create(&tid, NULL, alarm_thread, NULL);
-		if (rc < 0)
-			LOGE("Create alarm thread failed\n");
+	if (strcmp("charger", value))
+		return;
+
+	rb_secs = alarm_get_reboot_secs();
+	if (rb_secs < 0) {
+		LOGI("No power off alarm pending\n");
+		return;
 	}
+
+	if (alarm_timer_init(rb_secs) == 0)
+		return;
+
+	rc = pthread_create(&tid, NULL, alarm_thread, (void *)(intptr_t)rb_secs);
+	if (rc != 0)
+		LOGE("Create alarm thread failed\n");
 }
 
-void healthd_board_init(struct healthd_config*)
+/*
+ * adaptive polling
+ *
+ * healthd wakes every periodic_chores_interval_fast
+ * seconds while a charger is online and every
+ * periodic_chores_interval_slow seconds on battery.
+ * both are retuned after every update: short while
+ * the level moves quickly or the battery is hot,
+ * long while it is stable and the screen is off,
+ * otherwise what healthd set before board init
+ */
+#define POLL_FAST_MIN		30
+#define POLL_FAST_MAX		180
+#define POLL_SLOW_MIN		300
+#define POLL_SLOW_MAX		1800
+
+/* level change in percent per hour */
+#define RATE_QUICK		15
+#define RATE_STABLE		3
+#define RATE_MIN_SECS		60
+
+/* tenths of a degree celsius */
+#define TEMP_HOT		420
+
+#define SCREEN_PATH		"/sys/class/backlight/lm3533-backlight0/brightness"
+
+#define POLL_INTERVAL_PROP	"sys.healthd.poll_interval"
+#define WAKEUPS_SAVED_PROP	"sys.healthd.wakeups_saved"
+
+static struct healthd_config *poll_config;
+static int screen_fd = -1;
+
+static struct {
+	time_t level_time;
+	int level;
+	int rate;
+	time_t update_time;
+	bool charging;
+	int interval;
+	/* healthd's intervals, -1 turns one off */
+	int base_fast;
+	int base_slow;
+	/* thousandths of a wakeup */
+	long long saved;
+	long long saved_published;
+} poll;
+
+static bool poll_screen_on()
 {
-	// use defaults
+	char buf[16];
+	int rc;
+
+	if (screen_fd < 0) {
+		screen_fd = open(SCREEN_PATH, O_RDONLY | O_CLOEXEC);
+		if (screen_fd < 0)
+			return true;
+	}
+
+	rc = pread(screen_fd, buf, sizeof(buf) - 1, 0);
+	if (rc <= 0)
+		return true;
+	buf[rc] = '\0';
+	return atoi(buf) > 0;
+}
+
+static void poll_publish(const char *prop, long long value)
+{
+	char buf[PROP_VALUE_MAX];
+
+	snprintf(buf, sizeof(buf), "%lld", value);
+	property_set(prop, buf);
+}
+
+static void poll_policy_update(struct android::BatteryProperties *props)
+{
+	time_t now = boottime_secs();
+	bool charging = props->chargerAcOnline || props->chargerUsbOnline ||
+		props->chargerWirelessOnline;
+	bool hot = props->batteryTemperature >= TEMP_HOT;
+	bool screen_on = poll_screen_on();
+	int fast, slow, interval;
+
+	if (!poll.level_time || poll.charging != charging) {
+		/* start over, the rate of the other direction is useless */
+		poll.level_time = now;
+		poll.level = props->batteryLevel;
+		poll.rate = -1;
+	} else if (now - poll.level_time >= RATE_MIN_SECS) {
+		poll.rate = abs(props->batteryLevel - poll.level) * 3600 /
+			(now - poll.level_time);
+		poll.level_time = now;
+		poll.level = props->batteryLevel;
+	}
+
+	/*
+	 * every update is counted as a wakeup, the
+	 * base intervals would have taken one per
+	 * interval of the time since the last one
+	 */
+	if (poll.update_time) {
+		int base = poll.charging ? poll.base_fast : poll.base_slow;
+
+		if (base > 0)
+			poll.saved += (now - poll.update_time) * 1000LL / base - 1000;
+	}
+	poll.update_time = now;
+	poll.charging = charging;
+
+	if (hot || poll.rate >= RATE_QUICK) {
+		fast = POLL_FAST_MIN;
+		slow = POLL_SLOW_MIN;
+	} else if (poll.rate >= 0 && poll.rate <= RATE_STABLE && !screen_on) {
+		fast = POLL_FAST_MAX;
+		slow = POLL_SLOW_MAX;
+	} else {
+		fast = poll.base_fast;
+		slow = poll.base_slow;
+	}
+	/* leave an interval healthd turned off alone */
+	poll_config->periodic_chores_interval_fast = poll.base_fast > 0 ? fast : poll.base_fast;
+	poll_config->periodic_chores_interval_slow = poll.base_slow > 0 ? slow : poll.base_slow;
+
+	interval = charging ? poll_config->periodic_chores_interval_fast :
+		poll_config->periodic_chores_interval_slow;
+	if (interval != poll.interval) {
+		LOGV("battery poll interval %d s, rate %d %%/h, temp %d, screen %s\n",
+			 interval, poll.rate, props->batteryTemperature,
+			 screen_on ? "on" : "off");
+		poll.interval = interval;
+		poll_publish(POLL_INTERVAL_PROP, interval);
+	}
+	if (poll.saved / 1000 != poll.saved_published / 1000) {
+		poll.saved_published = poll.saved;
+		poll_publish(WAKEUPS_SAVED_PROP, poll.saved / 1000);
+	}
+}
+
+/*
+ * current and charge counter
+ *
+ * BatteryProperties has neither in L, so they
+ * are read here from the gauge nodes healthd_config
+ * points at, through fds opened on first use. -1
+ * when the gauge has no such node
+ */
+static struct {
+	int current_now_fd;
+	int charge_counter_fd;
+	bool has_current;
+	int current_now;
+	int charge_counter;
+} gauge = { -1, -1, false, -1, -1 };
+
+static bool gauge_read(const android::String8 &path, int *fd, int *value)
+{
+	char buf[32];
+	int rc;
+
+	if (*fd < 0) {
+		if (path.isEmpty())
+			return false;
+		*fd = open(path.string(), O_RDONLY | O_CLOEXEC);
+		if (*fd < 0)
+			return false;
+	}
+
+	rc = pread(*fd, buf, sizeof(buf) - 1, 0);
+	if (rc <= 0)
+		return false;
+	buf[rc] = '\0';
+	*value = strtol(buf, NULL, 10);
+	return true;
+}
+
+static void gauge_update()
+{
+	gauge.has_current = poll_config &&
+		gauge_read(poll_config->batteryCurrentNowPath,
+				   &gauge.current_now_fd, &gauge.current_now);
+	if (!gauge.has_current)
+		gauge.current_now = -1;
+	if (!poll_config ||
+		!gauge_read(poll_config->batteryChargeCounterPath,
+					&gauge.charge_counter_fd, &gauge.charge_counter))
+		gauge.charge_counter = -1;
+}
+
+/*
+ * time to full and time to empty
+ *
+ * estimated from the gauge's current_now, smoothed
+ * over about EST_TAU_SECS. charging is
+ * modelled as constant current up to EST_CV_LEVEL,
+ * then constant voltage with the current decaying
+ * exponentially down to EST_TERM_UA. -1 means no
+ * estimate, e.g. right after the charger changed
+ */
+#define EST_CAPACITY_UAH	3050000LL
+#define EST_CV_LEVEL		85
+#define EST_TERM_UA		150000
+#define EST_TAU_SECS		300
+#define EST_MIN_UA		5000
+
+#define TIME_TO_FULL_PROP	"sys.healthd.time_to_full"
+#define TIME_TO_EMPTY_PROP	"sys.healthd.time_to_empty"
+/* only republish when an estimate moved this much */
+#define EST_PUBLISH_SECS	60
+
+static struct {
+	bool charging;
+	time_t time;
+	/* microamps into the battery, negative discharging */
+	double current;
+	int time_to_full;
+	int time_to_empty;
+	int published_full;
+	int published_empty;
+} est = { false, 0, 0, -1, -1, -2, -2 };
+
+static long long est_remaining_uah(struct android::BatteryProperties *props, int to_level)
+{
+	return EST_CAPACITY_UAH * (to_level - props->batteryLevel) / 100;
+}
+
+/* seconds for the constant voltage phase from i0 down to termination */
+static double est_cv_secs(long long uah, double i0)
+{
+	if (i0 <= EST_TERM_UA)
+		return uah * 3600.0 / EST_TERM_UA;
+	return uah * 3600.0 / (i0 - EST_TERM_UA) * log(i0 / EST_TERM_UA);
+}
+
+static void est_publish(const char *prop, int value, int *published)
+{
+	char buf[PROP_VALUE_MAX];
+
+	if (value < 0 || *published < 0 ? value == *published :
+		abs(value - *published) < EST_PUBLISH_SECS)
+		return;
+	*published = value;
+	snprintf(buf, sizeof(buf), "%d", value);
+	property_set(prop, buf);
+}
+
+static void estimate_update(struct android::BatteryProperties *props)
+{
+	bool charging = props->chargerAcOnline || props->chargerUsbOnline ||
+		props->chargerWirelessOnline;
+	time_t now = boottime_secs();
+	/* the fuel gauge sign depends on the driver, go by the charger */
+	double current = abs(gauge.current_now);
+	double alpha;
+
+	if (!charging)
+		current = -current;
+
+	if (!gauge.has_current) {
+		/* nothing to go by, start over once there is */
+		est.time = 0;
+		est.current = 0;
+	} else {
+		if (!est.time || charging != est.charging) {
+			est.current = current;
+		} else if (now > est.time) {
+			alpha = (double)(now - est.time) / (now - est.time + EST_TAU_SECS);
+			est.current += alpha * (current - est.current);
+		}
+		est.time = now;
+	}
+	est.charging = charging;
+
+	est.time_to_full = -1;
+	est.time_to_empty = -1;
+	if (charging && props->batteryStatus == android::BATTERY_STATUS_FULL) {
+		est.time_to_full = 0;
+	} else if (charging && est.current > EST_MIN_UA) {
+		double secs;
+
+		if (props->batteryLevel < EST_CV_LEVEL) {
+			/* constant current to the cv point, then all of cv at that current */
+			secs = est_remaining_uah(props, EST_CV_LEVEL) * 3600.0 / est.current;
+			secs += est_cv_secs(est_remaining_uah(props, 100) -
+								est_remaining_uah(props, EST_CV_LEVEL), est.current);
+		} else {
+			secs = est_cv_secs(est_remaining_uah(props, 100), est.current);
+		}
+		est.time_to_full = (int)secs;
+	} else if (!charging && est.current < -EST_MIN_UA) {
+		est.time_to_empty = (int)(-est_remaining_uah(props, 0) * 3600.0 / -est.current);
+	}
+
+	est_publish(TIME_TO_FULL_PROP, est.time_to_full, &est.published_full);
+	est_publish(TIME_TO_EMPTY_PROP, est.time_to_empty, &est.published_empty);
+}
+
+/*
+ * battery snapshot
+ *
+ * every update is also written to a small
+ * shared file, battery_snapshot.h is the
+ * reader side. healthd is the only writer
+ */
+static struct battery_snapshot *snapshot;
+
+static void snapshot_init()
+{
+	char buf[80];
+	void *shm;
+	int fd;
+
+	/* init creates it, with its label */
+	fd = open(BATTERY_SNAPSHOT_PATH, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		LOGE("Can't open %s: %s\n", BATTERY_SNAPSHOT_PATH,
+			 strerror_r(errno, buf, sizeof(buf)));
+		return;
+	}
+
+	if (ftruncate(fd, sizeof(*snapshot)) < 0) {
+		LOGE("Can't size %s: %s\n", BATTERY_SNAPSHOT_PATH,
+			 strerror_r(errno, buf, sizeof(buf)));
+		close(fd);
+		return;
+	}
+
+	shm = mmap(NULL, sizeof(*snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		LOGE("Can't map %s: %s\n", BATTERY_SNAPSHOT_PATH,
+			 strerror_r(errno, buf, sizeof(buf)));
+		return;
+	}
+
+	snapshot = (struct battery_snapshot *)shm;
+	/* a reader seeing the magic sees an empty, even snapshot */
+	snapshot->seq = 0;
+	snapshot->version = BATTERY_SNAPSHOT_VERSION;
+	__atomic_store_n(&snapshot->magic, BATTERY_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void snapshot_update(struct android::BatteryProperties *props)
+{
+	struct timespec ts;
+	uint32_t seq = snapshot->seq;
+	uint32_t flags = 0;
+
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	if (props->batteryPresent)
+		flags |= BATTERY_SNAPSHOT_PRESENT;
+	if (props->chargerAcOnline)
+		flags |= BATTERY_SNAPSHOT_CHARGER_AC;
+	if (props->chargerUsbOnline)
+		flags |= BATTERY_SNAPSHOT_CHARGER_USB;
+	if (props->chargerWirelessOnline)
+		flags |= BATTERY_SNAPSHOT_CHARGER_WIRELESS;
+
+	__atomic_store_n(&snapshot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	snapshot->flags = flags;
+	snapshot->timestamp_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	snapshot->level = props->batteryLevel;
+	snapshot->voltage_mv = props->batteryVoltage;
+	snapshot->current_now_ua = gauge.current_now;
+	snapshot->charge_counter_uah = gauge.charge_counter;
+	snapshot->temperature = props->batteryTemperature;
+	snapshot->status = props->batteryStatus;
+	snapshot->health = props->batteryHealth;
+	snapshot->time_to_full_s = est.time_to_full;
+	snapshot->time_to_empty_s = est.time_to_empty;
+
+	__atomic_store_n(&snapshot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * battery history
+ *
+ * samples are staged in memory and copied into
+ * the mapped ring one batch at a time, so the
+ * flash sees at most one writeback of a couple
+ * of pages per batch. a batch is committed when
+ * it is full or its oldest sample is too old,
+ * a crash loses at most that much history
+ */
+#define HISTORY_BATCH		16
+#define HISTORY_BATCH_MAX_SECS	(30 * 60)
+
+static struct battery_history_header *history;
+static struct battery_history_entry history_batch[HISTORY_BATCH];
+static int history_staged;
+static time_t history_staged_at;
+static bool history_booted;
+
+static struct battery_history_header *history_map()
+{
+	struct battery_history_header *hdr;
+	char buf[80];
+	void *shm;
+	int fd;
+
+	fd = open(BATTERY_HISTORY_PATH, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		LOGV("Can't open %s: %s\n", BATTERY_HISTORY_PATH,
+			 strerror_r(errno, buf, sizeof(buf)));
+		return NULL;
+	}
+
+	if (ftruncate(fd, BATTERY_HISTORY_SIZE) < 0) {
+		LOGE("Can't size %s: %s\n", BATTERY_HISTORY_PATH,
+			 strerror_r(errno, buf, sizeof(buf)));
+		close(fd);
+		return NULL;
+	}
+
+	shm = mmap(NULL, BATTERY_HISTORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		LOGE("Can't map %s: %s\n", BATTERY_HISTORY_PATH,
+			 strerror_r(errno, buf, sizeof(buf)));
+		return NULL;
+	}
+
+	hdr = (struct battery_history_header *)shm;
+	if (hdr->magic != BATTERY_HISTORY_MAGIC ||
+		hdr->version != BATTERY_HISTORY_VERSION ||
+		hdr->entry_size != sizeof(struct battery_history_entry) ||
+		hdr->entries != BATTERY_HISTORY_ENTRIES ||
+		hdr->head >= BATTERY_HISTORY_ENTRIES ||
+		hdr->count > BATTERY_HISTORY_ENTRIES) {
+		LOGI("Starting a new battery history\n");
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->magic = BATTERY_HISTORY_MAGIC;
+		hdr->version = BATTERY_HISTORY_VERSION;
+		hdr->entry_size = sizeof(struct battery_history_entry);
+		hdr->entries = BATTERY_HISTORY_ENTRIES;
+	}
+	return hdr;
+}
+
+static void history_commit()
+{
+	struct battery_history_entry *ring;
+	int i;
+
+	/* /data may not be there yet, try again next batch */
+	if (!history && !(history = history_map()))
+		return;
+
+	ring = (struct battery_history_entry *)(history + 1);
+	for (i = 0; i < history_staged; i++) {
+		ring[history->head] = history_batch[i];
+		history->head = (history->head + 1) % BATTERY_HISTORY_ENTRIES;
+		if (history->count < BATTERY_HISTORY_ENTRIES)
+			history->count++;
+	}
+	history_staged = 0;
+}
+
+static void history_add(struct android::BatteryProperties *props)
+{
+	struct battery_history_entry *e;
+	time_t now = time(NULL);
+
+	/* the last commit failed, retry or drop that batch */
+	if (history_staged == HISTORY_BATCH)
+		history_commit();
+	if (history_staged == HISTORY_BATCH)
+		history_staged = 0;
+	if (!history_staged)
+		history_staged_at = now;
+
+	e = &history_batch[history_staged++];
+	memset(e, 0, sizeof(*e));
+	e->time = now;
+	e->current_now_ua = gauge.current_now;
+	e->voltage_mv = props->batteryVoltage;
+	e->temperature = props->batteryTemperature;
+	e->level = props->batteryLevel;
+	if (props->chargerAcOnline)
+		e->flags |= BATTERY_HISTORY_CHARGER_AC;
+	if (props->chargerUsbOnline)
+		e->flags |= BATTERY_HISTORY_CHARGER_USB;
+	if (props->chargerWirelessOnline)
+		e->flags |= BATTERY_HISTORY_CHARGER_WIRELESS;
+	if (!history_booted) {
+		e->flags |= BATTERY_HISTORY_BOOT;
+		history_booted = true;
+	}
+
+	if (history_staged == HISTORY_BATCH ||
+		now - history_staged_at >= HISTORY_BATCH_MAX_SECS)
+		history_commit();
+}
+
+/*
+ * battery paths
+ *
+ * the fuel gauge is always max170xx_battery, so
+ * the battery paths are filled in here from one
+ * read of its directory, instead of a probe per
+ * attribute. the ones it does not have are left
+ * empty for healthd to discover
+ */
+#define POWER_SUPPLY_BATTERY_PATH "/sys/class/power_supply/max170xx_battery"
+
+static const struct {
+	android::String8 healthd_config::*path;
+	const char *name;
+} battery_attrs[] = {
+	{ &healthd_config::batteryStatusPath,        "status" },
+	{ &healthd_config::batteryHealthPath,        "health" },
+	{ &healthd_config::batteryPresentPath,       "present" },
+	{ &healthd_config::batteryCapacityPath,      "capacity" },
+	{ &healthd_config::batteryVoltagePath,       "voltage_now" },
+	{ &healthd_config::batteryTemperaturePath,   "temp" },
+	{ &healthd_config::batteryTechnologyPath,    "technology" },
+	{ &healthd_config::batteryCurrentNowPath,    "current_now" },
+	{ &healthd_config::batteryCurrentAvgPath,    "current_avg" },
+	{ &healthd_config::batteryChargeCounterPath, "charge_counter" },
+};
+
+static void battery_paths_init(struct healthd_config *config)
+{
+	char buf[PATH_MAX];
+	unsigned int i, preset = 0;
+	struct dirent *entry;
+	DIR *dir;
+
+	dir = opendir(POWER_SUPPLY_BATTERY_PATH);
+	if (!dir) {
+		LOGE("No %s, discovering battery paths\n", POWER_SUPPLY_BATTERY_PATH);
+		return;
+	}
+
+	while ((entry = readdir(dir))) {
+		for (i = 0; i < sizeof(battery_attrs) / sizeof(battery_attrs[0]); i++) {
+			android::String8 &path = config->*battery_attrs[i].path;
+
+			if (strcmp(entry->d_name, battery_attrs[i].name) || !path.isEmpty())
+				continue;
+			snprintf(buf, sizeof(buf), "%s/%s", POWER_SUPPLY_BATTERY_PATH,
+					 entry->d_name);
+			path = buf;
+			preset++;
+		}
+	}
+	closedir(dir);
+
+	LOGI("%u of %zu battery paths preset\n", preset,
+		 sizeof(battery_attrs) / sizeof(battery_attrs[0]));
+}
+
+void healthd_board_init(struct healthd_config *config)
+{
+	battery_paths_init(config);
+	poll_config = config;
+	poll.base_fast = config->periodic_chores_interval_fast;
+	poll.base_slow = config->periodic_chores_interval_slow;
 	power_off_alarm_init();
+	snapshot_init();
 }
 
 
-int healthd_board_battery_update(struct android::BatteryProperties*)
+int healthd_board_battery_update(struct android::BatteryProperties *props)
 {
+	gauge_update();
+	if (poll_config)
+		poll_policy_update(props);
+	estimate_update(props);
+	if (snapshot)
+		snapshot_update(props);
+	history_add(props);
+
 	// return 0 to log periodic polled battery status to kernel log
 	return 1;
 }
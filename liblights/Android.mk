@@ -24,6 +24,10 @@ LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 
 LOCAL_SHARED_LIBRARIES := liblog
 
+ifeq ($(BOARD_LIGHTS_HW_BLINK),true)
+LOCAL_CFLAGS += -DLIGHTS_HW_BLINK
+endif
+
 LOCAL_MODULE := lights.pisces
 
 LOCAL_MODULE_TAGS := optional
@@ -19,51 +19,491 @@
 #define LOG_TAG "lights"
 #include <cutils/log.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <hardware/lights.h>
+#include <hardware/lights_pisces.h>
 
-static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+/* one lock per light type, a slow LED update never holds up the backlight */
+static pthread_mutex_t g_backlight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_buttons_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_led_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static struct light_state_t g_attention;
 static struct light_state_t g_notification;
 static struct light_state_t g_battery;
 static struct light_state_t g_speaker_light;
 
-char const *const LCD_0_FILE  = "/sys/class/backlight/lm3533-backlight0/brightness";
-char const *const LCD_1_FILE  = "/sys/class/backlight/lm3533-backlight1/brightness";
-char const *const BUTTON_FILE = "/sys/class/leds/button-backlight/brightness";
+#define LCD_0_FILE  "/sys/class/backlight/lm3533-backlight0/brightness"
+#define LCD_1_FILE  "/sys/class/backlight/lm3533-backlight1/brightness"
+#define BUTTON_FILE "/sys/class/leds/button-backlight/brightness"
 
-char const *const LED_RED_FILE    = "/sys/class/leds/red/brightness";
-char const *const LED_GREEN_FILE  = "/sys/class/leds/green/brightness";
-char const *const LED_BLUE_FILE   = "/sys/class/leds/blue/brightness";
-char const *const LED_UPDATE_FILE = "/sys/class/leds/red/update";
+#define LED_RED_FILE    "/sys/class/leds/red/brightness"
+#define LED_GREEN_FILE  "/sys/class/leds/green/brightness"
+#define LED_BLUE_FILE   "/sys/class/leds/blue/brightness"
+#define LED_UPDATE_FILE "/sys/class/leds/red/update"
 
+/* delay_on/delay_off only exist while the timer trigger is active */
+#define LED_RED_TRIGGER_FILE     "/sys/class/leds/red/trigger"
+#define LED_GREEN_TRIGGER_FILE   "/sys/class/leds/green/trigger"
+#define LED_BLUE_TRIGGER_FILE    "/sys/class/leds/blue/trigger"
+#define LED_RED_DELAY_ON_FILE    "/sys/class/leds/red/delay_on"
+#define LED_GREEN_DELAY_ON_FILE  "/sys/class/leds/green/delay_on"
+#define LED_BLUE_DELAY_ON_FILE   "/sys/class/leds/blue/delay_on"
+#define LED_RED_DELAY_OFF_FILE   "/sys/class/leds/red/delay_off"
+#define LED_GREEN_DELAY_OFF_FILE "/sys/class/leds/green/delay_off"
+#define LED_BLUE_DELAY_OFF_FILE  "/sys/class/leds/blue/delay_off"
 
-static int write_int(char const *path, int value)
-{
+enum {
+	LCD_0,
+	LCD_1,
+	BUTTON,
+	LED_RED,
+	LED_GREEN,
+	LED_BLUE,
+	LED_UPDATE,
+	LED_RED_TRIGGER,
+	LED_GREEN_TRIGGER,
+	LED_BLUE_TRIGGER,
+	LED_RED_DELAY_ON,
+	LED_GREEN_DELAY_ON,
+	LED_BLUE_DELAY_ON,
+	LED_RED_DELAY_OFF,
+	LED_GREEN_DELAY_OFF,
+	LED_BLUE_DELAY_OFF,
+	NODE_COUNT,
+};
+
+/*
+ * nodes are opened once by open_lights and kept open, a value is a
+ * single pwrite. each node is only written by one light type.
+ * value is the last number written, -1 when unknown
+ */
+static struct sysfs_node {
+	char const *path;
 	int fd;
+	int value;
+} g_nodes[NODE_COUNT] = {
+	[LCD_0]      = { LCD_0_FILE,      -1, -1 },
+	[LCD_1]      = { LCD_1_FILE,      -1, -1 },
+	[BUTTON]     = { BUTTON_FILE,     -1, -1 },
+	[LED_RED]    = { LED_RED_FILE,    -1, -1 },
+	[LED_GREEN]  = { LED_GREEN_FILE,  -1, -1 },
+	[LED_BLUE]   = { LED_BLUE_FILE,   -1, -1 },
+	[LED_UPDATE] = { LED_UPDATE_FILE, -1, -1 },
+	[LED_RED_TRIGGER]     = { LED_RED_TRIGGER_FILE,     -1, -1 },
+	[LED_GREEN_TRIGGER]   = { LED_GREEN_TRIGGER_FILE,   -1, -1 },
+	[LED_BLUE_TRIGGER]    = { LED_BLUE_TRIGGER_FILE,    -1, -1 },
+	[LED_RED_DELAY_ON]    = { LED_RED_DELAY_ON_FILE,    -1, -1 },
+	[LED_GREEN_DELAY_ON]  = { LED_GREEN_DELAY_ON_FILE,  -1, -1 },
+	[LED_BLUE_DELAY_ON]   = { LED_BLUE_DELAY_ON_FILE,   -1, -1 },
+	[LED_RED_DELAY_OFF]   = { LED_RED_DELAY_OFF_FILE,   -1, -1 },
+	[LED_GREEN_DELAY_OFF] = { LED_GREEN_DELAY_OFF_FILE, -1, -1 },
+	[LED_BLUE_DELAY_OFF]  = { LED_BLUE_DELAY_OFF_FILE,  -1, -1 },
+};
+
+/*
+ * counters read by lights_dump from any thread. updates are batches that
+ * reached the hardware, syscalls are the opens, writes and closes they
+ * took, skipped are channel writes saved by the shadow values
+ */
+enum {
+	TYPE_BACKLIGHT,
+	TYPE_BUTTONS,
+	TYPE_LED,
+	TYPE_COUNT,
+};
+
+static struct light_stats {
+	uint32_t calls;
+	uint32_t updates;
+	uint32_t syscalls;
+	uint32_t skipped;
+} g_stats[TYPE_COUNT];
+
+/*
+ * LIGHTS_SYSFS_ROOT in the environment of the first open_lights puts
+ * every node under that directory instead of /, for tests on a fake tree
+ */
+#define SYSFS_ROOT_ENV "LIGHTS_SYSFS_ROOT"
+
+static char g_sysfs_root[PATH_MAX / 2];
+
+static int node_type(int node)
+{
+	return node <= LCD_1 ? TYPE_BACKLIGHT : node == BUTTON ? TYPE_BUTTONS : TYPE_LED;
+}
+
+static void stat_inc(uint32_t *stat)
+{
+	__atomic_add_fetch(stat, 1, __ATOMIC_RELAXED);
+}
+
+static int open_node(int node)
+{
+	struct sysfs_node *n = &g_nodes[node];
 	static int already_warned = 0;
 
-	ALOGV("write_int: path %s, value %d", path, value);
-	fd = open(path, O_RDWR);
-	if (fd >= 0) {
-		char buffer[20];
-		int bytes = sprintf(buffer, "%d\n", value);
-		int amt = write(fd, buffer, bytes);
-		close(fd);
-		return amt == -1 ? -errno : 0;
-	} else {
-		if (already_warned == 0) {
-			ALOGE("write_int failed to open %s\n", path);
-			already_warned = 1;
+	if (n->fd < 0) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s%s", g_sysfs_root, n->path);
+		stat_inc(&g_stats[node_type(node)].syscalls);
+		n->fd = open(path, O_RDWR | O_CLOEXEC);
+		if (n->fd < 0) {
+			if (already_warned == 0) {
+				ALOGE("write_int failed to open %s\n", path);
+				already_warned = 1;
+			}
+			return -errno;
+		}
+	}
+	return 0;
+}
+
+static int write_str(int node, char const *buffer)
+{
+	struct sysfs_node *n = &g_nodes[node];
+	int bytes = strlen(buffer);
+	int err, retry;
+
+	ALOGV("write_str: path %s, value %s", n->path, buffer);
+	for (retry = 0; ; retry++) {
+		err = open_node(node);
+		if (err) {
+			return err;
+		}
+		stat_inc(&g_stats[node_type(node)].syscalls);
+		if (pwrite(n->fd, buffer, bytes, 0) >= 0) {
+			return 0;
+		}
+
+		/* the node may have gone away and come back, reopen once */
+		err = -errno;
+		stat_inc(&g_stats[node_type(node)].syscalls);
+		close(n->fd);
+		n->fd = -1;
+		if (retry) {
+			return err;
+		}
+	}
+}
+
+static int write_int(int node, int value)
+{
+	char buffer[20];
+
+	sprintf(buffer, "%d\n", value);
+	return write_str(node, buffer);
+}
+
+/*
+ * write value unless it is what the node already holds. returns 1 if
+ * it was written, 0 if skipped, or a negative errno
+ */
+static int update_int(int node, int value)
+{
+	struct sysfs_node *n = &g_nodes[node];
+	int err;
+
+	if (n->value == value) {
+		stat_inc(&g_stats[node_type(node)].skipped);
+		return 0;
+	}
+	err = write_int(node, value);
+	n->value = err ? -1 : value;
+	return err ? err : 1;
+}
+
+/*
+ * deferred work runs on worker threads, each an epoll loop woken by
+ * timerfds and eventfds. the backlight has its own so LED effects never
+ * delay it
+ */
+struct lights_worker {
+	int epoll;
+	char const *name;
+	int nice;
+};
+
+struct worker_source {
+	int fd;
+	void (*fire)(void);
+};
+
+static struct lights_worker g_backlight_worker = { -1, "backlight", 0 };
+/* LED effects are decoration, they should never compete with the UI */
+static struct lights_worker g_led_worker = { -1, "led", 10 };
+
+static void *lights_worker(void *arg)
+{
+	struct lights_worker *worker = arg;
+	struct epoll_event events[4];
+	uint64_t expirations;
+	int i, n;
+
+	if (worker->nice) {
+		setpriority(PRIO_PROCESS, 0, worker->nice);
+	}
+
+	for (;;) {
+		n = epoll_wait(worker->epoll, events, sizeof(events) / sizeof(events[0]), -1);
+		for (i = 0; i < n; i++) {
+			struct worker_source *source = events[i].data.ptr;
+
+			if (read(source->fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+				source->fire();
+			}
 		}
+	}
+	return NULL;
+}
+
+static int worker_start(struct lights_worker *worker)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err = 0;
+
+	worker->epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (worker->epoll < 0) {
+		ALOGE("epoll_create1 failed: %s", strerror(errno));
+		return -errno;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, lights_worker, worker)) {
+		ALOGE("can't create %s worker", worker->name);
+		close(worker->epoll);
+		worker->epoll = -1;
+		err = -EAGAIN;
+	}
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
+static int worker_add(struct lights_worker *worker, struct worker_source *source, int fd)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = source;
+	if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &ev)) {
+		ALOGE("epoll_ctl failed: %s", strerror(errno));
+		close(fd);
 		return -errno;
 	}
+	source->fd = fd;
+	return 0;
+}
+
+static int worker_add_timer(struct lights_worker *worker, struct worker_source *timer)
+{
+	int fd;
+
+	if (worker->epoll < 0) {
+		return -ENODEV;
+	}
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		ALOGE("timerfd_create failed: %s", strerror(errno));
+		return -errno;
+	}
+	return worker_add(worker, timer, fd);
+}
+
+static int worker_add_event(struct lights_worker *worker, struct worker_source *event)
+{
+	int fd;
+
+	if (worker->epoll < 0) {
+		return -ENODEV;
+	}
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		ALOGE("eventfd failed: %s", strerror(errno));
+		return -errno;
+	}
+	return worker_add(worker, event, fd);
+}
+
+/*
+ * an eventfd write is all or nothing. EAGAIN means the counter is
+ * already as high as it goes, the worker is woken up by that too
+ */
+static int event_signal(struct worker_source *event)
+{
+	uint64_t one = 1;
+	ssize_t n;
+
+	do {
+		n = write(event->fd, &one, sizeof(one));
+	} while (n < 0 && errno == EINTR);
+
+	if (n == sizeof(one) || (n < 0 && errno == EAGAIN)) {
+		return 0;
+	}
+	ALOGE("eventfd write failed: %s", n < 0 ? strerror(errno) : "short write");
+	return n < 0 ? -errno : -EIO;
+}
+
+/* first after ms, then every interval_ms if not 0. ms 0 disarms */
+static void timer_arm(struct worker_source *timer, int ms, int interval_ms)
+{
+	struct itimerspec its;
+
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	timerfd_settime(timer->fd, 0, &its, NULL);
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void led_reset_fire(void);
+
+/* LED off time before a new color, so the controller restarts its timer */
+#define LED_RESET_MS 100
+
+static struct worker_source g_led_reset_timer = { -1, led_reset_fire };
+static int g_led_reset_pending;
+
+static void led_frame_fire(void);
+
+/*
+ * set_led_effect plays an effect on the LED, a brightness curve over the
+ * color repeated every period_ms, and cycling goes through the colors of
+ * every lit state. the flash mode from set_light is ignored meanwhile,
+ * LIGHT_FLASH_HARDWARE stays with the kernel timer trigger. the first
+ * frame is written right away, the LED worker renders the following
+ * ones, one per LED_FRAME_MS, and its timer is disarmed when the LED is
+ * off or no effect is set
+ */
+#define LED_FRAME_MS      33
+#define LED_PERIOD_MIN_MS 500
+#define LED_PERIOD_MAX_MS 10000
+
+/* (0.5 - 0.5 cos) ^ 2.2 over one period */
+static const uint8_t g_breathe_curve[] = {
+	  0,   0,   0,   0,   0,   1,   1,   2,   4,   6,   9,  14,  19,  26,  34,  44,
+	 55,  68,  82,  97, 113, 130, 147, 164, 180, 196, 210, 223, 234, 243, 250, 254,
+	255, 254, 250, 243, 234, 223, 210, 196, 180, 164, 147, 130, 113,  97,  82,  68,
+	 55,  44,  34,  26,  19,  14,   9,   6,   4,   2,   1,   1,   0,   0,   0,   0,
+};
+
+/* quick rise, then exponential decay */
+static const uint8_t g_pulse_curve[] = {
+	  0,  12,  55, 135, 255, 209, 171, 140, 115,  94,  77,  63,  51,  42,  35,  28,
+	 23,  19,  16,  13,  10,   9,   7,   6,   5,   4,   3,   3,   2,   2,   1,   1,
+};
+
+static struct worker_source g_led_frame_timer = { -1, led_frame_fire };
+
+/* curve is NULL without an effect, playing while the timer is armed */
+static struct led_effect {
+	int effect;
+	uint8_t const *curve;
+	int length;
+	int period_ms;
+	int cycle;
+	int playing;
+	int64_t start;
+} g_led_effect;
+
+static void backlight_ramp_fire(void);
+
+/*
+ * set_light on the backlight with LIGHT_FLASH_HARDWARE ramps to the new
+ * brightness over flashOnMS instead of jumping, one HAL call per
+ * transition. a new brightness replaces an active ramp, starting from
+ * wherever it got to
+ */
+#define RAMP_STEP_MS 16
+#define RAMP_MAX_MS  10000
+
+static struct worker_source g_backlight_ramp_timer = { -1, backlight_ramp_fire };
+static int g_backlight = -1;
+static int g_ramp_from;
+static int g_ramp_to;
+static int g_ramp_ms;
+static int64_t g_ramp_start;
+
+static void backlight_mailbox_fire(void);
+
+/*
+ * set_light_backlight only posts the request here and returns, the
+ * backlight worker applies whatever is newest when it gets to it.
+ * requests overwritten before that are counted as coalesced.
+ * 0 is empty, else MAILBOX_FULL | ramp ms << 9 | brightness
+ */
+#define MAILBOX_FULL            (1u << 31)
+#define MAILBOX_BRIGHTNESS_MASK 0x1ff
+#define MAILBOX_RAMP_SHIFT      9
+
+static struct worker_source g_backlight_mailbox = { -1, backlight_mailbox_fire };
+static uint32_t g_backlight_request;
+static uint32_t g_backlight_posted;
+static uint32_t g_backlight_coalesced;
+
+static void button_timer_fire(void);
+
+/*
+ * with a timeout set through set_button_timeout the HAL switches the
+ * keys off itself once there was no user_activity for that long, and
+ * back on at the next one. user_activity only stores a timestamp while
+ * the keys are lit, the timer checks it when it fires and rearms for
+ * the rest
+ */
+static struct worker_source g_button_timer = { -1, button_timer_fire };
+static int g_button_timeout_ms;
+static int g_button_brightness;
+static int g_buttons_lit;
+static int64_t g_button_activity;
+static uint32_t g_button_activity_calls;
+
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+
+static void lights_init(void)
+{
+	char const *root = getenv(SYSFS_ROOT_ENV);
+
+	if (root) {
+		ALOGI("sysfs nodes under %s", root);
+		snprintf(g_sysfs_root, sizeof(g_sysfs_root), "%s", root);
+	}
+
+	if (!worker_start(&g_backlight_worker)) {
+		worker_add_timer(&g_backlight_worker, &g_backlight_ramp_timer);
+		worker_add_event(&g_backlight_worker, &g_backlight_mailbox);
+		worker_add_timer(&g_backlight_worker, &g_button_timer);
+	}
+	if (!worker_start(&g_led_worker)) {
+		worker_add_timer(&g_led_worker, &g_led_reset_timer);
+		worker_add_timer(&g_led_worker, &g_led_frame_timer);
+	}
 }
 
 static int is_lit(struct light_state_t const* state)
@@ -79,12 +519,35 @@ static int rgb_to_brightness(struct light_state_t const *state)
 			+ (150*((color>>8) & 0x00ff)) + (29*(color & 0x00ff))) >> 8;
 }
 
-static int rgb_to_brightness_2(struct light_state_t const *state)
-{
-	int color = state->color & 0x00ffffff;
+/*
+ * the panel is lit by two lm3533 banks, 0-255 each, and both get the
+ * backlight level: the brightness values of the overlay are calibrated
+ * for that. each bank is trimmed by BANKn_TRIM / 256 to match the two
+ * halves of the panel. a lit level never leaves a bank at 0, that would
+ * turn half the panel off. the table is built by the preprocessor,
+ * set_light only indexes it
+ */
+#define BANK0_TRIM 256
+#define BANK1_TRIM 256
+
+#define BL_BANK(l, trim) \
+	((l) && (l) * (trim) / 256 < 1 ? 1 : (l) * (trim) / 256 > 255 ? 255 : (l) * (trim) / 256)
+#define BL_PAIR(l)      { BL_BANK(l, BANK0_TRIM), BL_BANK(l, BANK1_TRIM) }
+#define BL_PAIRS4(l)    BL_PAIR(l), BL_PAIR((l) + 1), BL_PAIR((l) + 2), BL_PAIR((l) + 3)
+#define BL_PAIRS16(l)   BL_PAIRS4(l), BL_PAIRS4((l) + 4), BL_PAIRS4((l) + 8), BL_PAIRS4((l) + 12)
+#define BL_PAIRS64(l)   BL_PAIRS16(l), BL_PAIRS16((l) + 16), BL_PAIRS16((l) + 32), BL_PAIRS16((l) + 48)
 
-	return ((2*77*((color>>16) & 0x00ff))
-			+ (2*150*((color>>8) & 0x00ff)) + (2*29*(color & 0x00ff))) >> 8;
+static const struct backlight_pair {
+	uint8_t bank0;
+	uint8_t bank1;
+} g_backlight_lut[256] = {
+	BL_PAIRS64(0), BL_PAIRS64(64), BL_PAIRS64(128), BL_PAIRS64(192),
+};
+
+/* the framework sends the level as gray, any channel will do */
+static int rgb_to_backlight(struct light_state_t const *state)
+{
+	return (state->color >> 8) & 0xff;
 }
 
 static void dump_light_state(char const* name, struct light_state_t const* state)
@@ -99,66 +562,434 @@ static void dump_light_state(char const* name, struct light_state_t const* state
 		  );
 }
 
+/* the sysfs shadow skips banks that already hold their value */
+static int write_backlight_locked(int level)
+{
+	struct backlight_pair const *pair = &g_backlight_lut[level];
+	int err0 = update_int(LCD_0, pair->bank0);
+	int err1 = update_int(LCD_1, pair->bank1);
+
+	g_backlight = level;
+	__atomic_add_fetch(&g_stats[TYPE_BACKLIGHT].updates, err0 > 0 || err1 > 0,
+			__ATOMIC_RELAXED);
+	return err0 < 0 ? err0 : err1 < 0 ? err1 : 0;
+}
+
+static void backlight_ramp_fire(void)
+{
+	pthread_mutex_lock(&g_backlight_lock);
+	if (g_ramp_ms) {
+		int64_t elapsed = now_ms() - g_ramp_start;
+
+		if (elapsed >= g_ramp_ms) {
+			g_ramp_ms = 0;
+			timer_arm(&g_backlight_ramp_timer, 0, 0);
+			write_backlight_locked(g_ramp_to);
+		} else {
+			write_backlight_locked(g_ramp_from
+					+ (int)((g_ramp_to - g_ramp_from) * elapsed / g_ramp_ms));
+		}
+	}
+	pthread_mutex_unlock(&g_backlight_lock);
+}
+
+/* called with g_backlight_lock held */
+static int set_backlight_locked(int brightness, int ramp_ms)
+{
+	if (ramp_ms > 0 && g_backlight >= 0 && g_backlight_ramp_timer.fd >= 0) {
+		g_ramp_from = g_backlight;
+		g_ramp_to = brightness;
+		g_ramp_ms = ramp_ms;
+		g_ramp_start = now_ms();
+		timer_arm(&g_backlight_ramp_timer, RAMP_STEP_MS, RAMP_STEP_MS);
+		return 0;
+	}
+
+	if (g_ramp_ms) {
+		g_ramp_ms = 0;
+		timer_arm(&g_backlight_ramp_timer, 0, 0);
+	}
+	return write_backlight_locked(brightness);
+}
+
+static void backlight_mailbox_fire(void)
+{
+	uint32_t request = __atomic_exchange_n(&g_backlight_request, 0, __ATOMIC_ACQUIRE);
+
+	if (request) {
+		pthread_mutex_lock(&g_backlight_lock);
+		set_backlight_locked(request & MAILBOX_BRIGHTNESS_MASK,
+				(request & ~MAILBOX_FULL) >> MAILBOX_RAMP_SHIFT);
+		pthread_mutex_unlock(&g_backlight_lock);
+	}
+}
+
 static int set_light_backlight(struct light_device_t* dev, struct light_state_t const* state)
 {
-	int err = 0;
-	int brightness = rgb_to_brightness_2(state);
-	static int old_brightness = -1;
-
-	pthread_mutex_lock(&g_lock);
-	if (old_brightness < 0 || (old_brightness != brightness)) {
-		err = write_int(LCD_0_FILE, brightness / 2);
-		if (!err) {
-			err = write_int(LCD_1_FILE, (brightness + 1) / 2);
+	int err;
+	int brightness = rgb_to_backlight(state);
+	int ramp_ms = 0;
+
+	stat_inc(&g_stats[TYPE_BACKLIGHT].calls);
+	if (state->flashMode == LIGHT_FLASH_HARDWARE && state->flashOnMS > 0) {
+		ramp_ms = state->flashOnMS < RAMP_MAX_MS ? state->flashOnMS : RAMP_MAX_MS;
+	}
+
+	if (g_backlight_mailbox.fd >= 0) {
+		uint32_t request = MAILBOX_FULL | ramp_ms << MAILBOX_RAMP_SHIFT | brightness;
+
+		__atomic_add_fetch(&g_backlight_posted, 1, __ATOMIC_RELAXED);
+		if (__atomic_exchange_n(&g_backlight_request, request, __ATOMIC_RELEASE)) {
+			/* the worker has not taken the last one yet, it will take this instead */
+			__atomic_add_fetch(&g_backlight_coalesced, 1, __ATOMIC_RELAXED);
+		} else if (event_signal(&g_backlight_mailbox)) {
+			/* the worker won't hear of it, apply it here */
+			backlight_mailbox_fire();
 		}
+		return 0;
 	}
-	old_brightness = brightness;
-	pthread_mutex_unlock(&g_lock);
 
+	pthread_mutex_lock(&g_backlight_lock);
+	err = set_backlight_locked(brightness, ramp_ms);
+	pthread_mutex_unlock(&g_backlight_lock);
+
+	return err;
+}
+
+static int write_buttons_locked(int brightness)
+{
+	int err = update_int(BUTTON, brightness);
+
+	if (err > 0) {
+		stat_inc(&g_stats[TYPE_BUTTONS].updates);
+		err = 0;
+	}
 	return err;
 }
 
+/* called with g_buttons_lock held */
+static int buttons_on_locked(void)
+{
+	__atomic_store_n(&g_button_activity, now_ms(), __ATOMIC_RELAXED);
+	if (!g_buttons_lit) {
+		timer_arm(&g_button_timer, g_button_timeout_ms, 0);
+		__atomic_store_n(&g_buttons_lit, 1, __ATOMIC_RELEASE);
+	}
+	return write_buttons_locked(g_button_brightness);
+}
+
+static void buttons_off_locked(void)
+{
+	timer_arm(&g_button_timer, 0, 0);
+	__atomic_store_n(&g_buttons_lit, 0, __ATOMIC_RELEASE);
+	write_buttons_locked(0);
+}
+
+static void button_timer_fire(void)
+{
+	pthread_mutex_lock(&g_buttons_lock);
+	if (g_buttons_lit && g_button_timeout_ms) {
+		int64_t idle = now_ms() - __atomic_load_n(&g_button_activity, __ATOMIC_RELAXED);
+
+		if (idle >= g_button_timeout_ms) {
+			/*
+			 * clear lit before looking at the activity again. a touch
+			 * on the fast path of lights_user_activity is then either
+			 * seen here, or sees the keys off and takes the lock
+			 */
+			__atomic_store_n(&g_buttons_lit, 0, __ATOMIC_SEQ_CST);
+			idle = now_ms() - __atomic_load_n(&g_button_activity, __ATOMIC_SEQ_CST);
+		}
+		if (idle >= g_button_timeout_ms) {
+			buttons_off_locked();
+		} else {
+			__atomic_store_n(&g_buttons_lit, 1, __ATOMIC_RELEASE);
+			timer_arm(&g_button_timer, g_button_timeout_ms - idle, 0);
+		}
+	}
+	pthread_mutex_unlock(&g_buttons_lock);
+}
+
 static int set_light_buttons(struct light_device_t* dev, struct light_state_t const* state)
 {
 	int err = 0;
 	int brightness = rgb_to_brightness(state);
-	static int old_brightness = -1;
 
-	pthread_mutex_lock(&g_lock);
-	if (old_brightness < 0 || (old_brightness != brightness)) {
-		err = write_int(BUTTON_FILE, brightness);
+	stat_inc(&g_stats[TYPE_BUTTONS].calls);
+	pthread_mutex_lock(&g_buttons_lock);
+	g_button_brightness = brightness;
+	if (!g_button_timeout_ms) {
+		err = write_buttons_locked(brightness);
+	} else if (brightness) {
+		err = buttons_on_locked();
+	} else {
+		buttons_off_locked();
+	}
+	pthread_mutex_unlock(&g_buttons_lock);
+
+	return err;
+}
+
+static int lights_set_button_timeout(pisces_light_device_t *dev __unused, int timeout_ms)
+{
+	if (timeout_ms < 0) {
+		return -EINVAL;
+	}
+	if (g_button_timer.fd < 0) {
+		return -ENODEV;
+	}
+
+	pthread_mutex_lock(&g_buttons_lock);
+	g_button_timeout_ms = timeout_ms;
+	if (!timeout_ms) {
+		/* back to the framework switching the keys */
+		timer_arm(&g_button_timer, 0, 0);
+		__atomic_store_n(&g_buttons_lit, 0, __ATOMIC_RELEASE);
+		write_buttons_locked(g_button_brightness);
+	} else if (g_button_brightness) {
+		buttons_on_locked();
+	}
+	pthread_mutex_unlock(&g_buttons_lock);
+	return 0;
+}
+
+static int lights_user_activity(pisces_light_device_t *dev __unused)
+{
+	int err = 0;
+
+	stat_inc(&g_button_activity_calls);
+	if (__atomic_load_n(&g_buttons_lit, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&g_button_activity, now_ms(), __ATOMIC_SEQ_CST);
+		/* button_timer_fire may have switched the keys off before this touch */
+		if (__atomic_load_n(&g_buttons_lit, __ATOMIC_SEQ_CST)) {
+			return 0;
+		}
+	}
+
+	pthread_mutex_lock(&g_buttons_lock);
+	if (g_button_timeout_ms && g_button_brightness) {
+		err = buttons_on_locked();
 	}
-	old_brightness = brightness;
-	pthread_mutex_unlock(&g_lock);
+	pthread_mutex_unlock(&g_buttons_lock);
+	return err;
+}
+
+/*
+ * blinking is handed to the LED class timer trigger, so nothing in
+ * userspace wakes up for it. without the trigger the LED stays solid
+ *
+ * the trigger only keeps blinking in suspend if the LED driver has
+ * blink_set and the controller runs it. otherwise the kernel blinks
+ * from a timer that stops with the CPU, and the LED sits in whatever
+ * phase it was in, maybe off. LIGHTS_HW_BLINK, BOARD_LIGHTS_HW_BLINK
+ * in BoardConfig.mk, says the driver has it, without it flashing
+ * states are shown solid
+ */
+static int g_led_blinking;
+static struct light_state_t const g_led_off;
+
+static const struct led_channel {
+	int shift;
+	int brightness;
+	int trigger;
+	int delay_on;
+	int delay_off;
+} g_led_channels[] = {
+	{ 16, LED_RED,   LED_RED_TRIGGER,   LED_RED_DELAY_ON,   LED_RED_DELAY_OFF   },
+	{ 8,  LED_GREEN, LED_GREEN_TRIGGER, LED_GREEN_DELAY_ON, LED_GREEN_DELAY_OFF },
+	{ 0,  LED_BLUE,  LED_BLUE_TRIGGER,  LED_BLUE_DELAY_ON,  LED_BLUE_DELAY_OFF  },
+};
+
+static int is_blinking(struct light_state_t const* state)
+{
+#ifdef LIGHTS_HW_BLINK
+	return (state->flashMode == LIGHT_FLASH_TIMED || state->flashMode == LIGHT_FLASH_HARDWARE)
+		&& state->flashOnMS > 0 && state->flashOffMS > 0;
+#else
+	return 0;
+#endif
+}
+
+static int same_light_state(struct light_state_t const* a, struct light_state_t const* b)
+{
+	return a->color == b->color && a->flashMode == b->flashMode
+		&& (a->flashMode == LIGHT_FLASH_NONE
+			|| (a->flashOnMS == b->flashOnMS && a->flashOffMS == b->flashOffMS));
+}
+
+/* brightness must be written first, it stops any blinking */
+static int blink_channel_locked(struct led_channel const *channel, int on_ms, int off_ms)
+{
+	int err = write_str(channel->trigger, "timer\n");
 
+	if (!err) {
+		err = write_int(channel->delay_on, on_ms);
+	}
+	if (!err) {
+		err = write_int(channel->delay_off, off_ms);
+	}
+	if (err) {
+		write_str(channel->trigger, "none\n");
+	}
 	return err;
 }
 
+static int write_speaker_light_locked(struct light_state_t const* state)
+{
+	int blink = is_blinking(state);
+	int blinking = 0;
+	int changed = g_led_blinking;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(g_led_channels) / sizeof(g_led_channels[0]); i++) {
+		struct led_channel const *channel = &g_led_channels[i];
+		int value = (state->color >> channel->shift) & 0xFF;
+
+		if (g_led_blinking) {
+			/* dropping the trigger also turns the channel off */
+			write_str(channel->trigger, "none\n");
+			g_nodes[channel->brightness].value = -1;
+		}
+		if (update_int(channel->brightness, value) > 0) {
+			changed = 1;
+		}
+		if (blink && value && !blink_channel_locked(channel, state->flashOnMS, state->flashOffMS)) {
+			blinking = 1;
+			changed = 1;
+		}
+	}
+	g_led_blinking = blinking;
+
+	/* update latches all channels at once, once per batch is enough */
+	if (!changed) {
+		return 0;
+	}
+	stat_inc(&g_stats[TYPE_LED].updates);
+	return write_int(LED_UPDATE, 1);
+}
+
+/* the LED has been off long enough, show the latest color */
+static void led_reset_fire(void)
+{
+	pthread_mutex_lock(&g_led_lock);
+	if (g_led_reset_pending) {
+		g_led_reset_pending = 0;
+		write_speaker_light_locked(&g_speaker_light);
+	}
+	pthread_mutex_unlock(&g_led_lock);
+}
+
+/* one effect frame, only channels that changed are written */
+static void write_led_frame_locked(unsigned int color, int level)
+{
+	int changed = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(g_led_channels) / sizeof(g_led_channels[0]); i++) {
+		struct led_channel const *channel = &g_led_channels[i];
+		int value = ((color >> channel->shift) & 0xFF) * level / 255;
+
+		if (update_int(channel->brightness, value) > 0) {
+			changed = 1;
+		}
+	}
+	if (changed) {
+		stat_inc(&g_stats[TYPE_LED].updates);
+		write_int(LED_UPDATE, 1);
+	}
+}
+
+static void led_frame_render_locked(void)
+{
+	struct light_state_t const *lit[3];
+	int64_t elapsed = now_ms() - g_led_effect.start;
+	int count = 0;
+
+	lit[count++] = &g_speaker_light;
+	if (g_led_effect.cycle) {
+		if (is_lit(&g_notification) && g_notification.color != g_speaker_light.color) {
+			lit[count++] = &g_notification;
+		}
+		if (is_lit(&g_battery) && g_battery.color != g_speaker_light.color) {
+			lit[count++] = &g_battery;
+		}
+	}
+
+	write_led_frame_locked(lit[(elapsed / g_led_effect.period_ms) % count]->color,
+			g_led_effect.curve[(elapsed % g_led_effect.period_ms)
+				* g_led_effect.length / g_led_effect.period_ms]);
+}
+
+static void led_frame_fire(void)
+{
+	pthread_mutex_lock(&g_led_lock);
+	if (g_led_effect.playing) {
+		led_frame_render_locked();
+	}
+	pthread_mutex_unlock(&g_led_lock);
+}
+
+static void led_effect_stop_locked(void)
+{
+	if (g_led_effect.playing) {
+		g_led_effect.playing = 0;
+		timer_arm(&g_led_frame_timer, 0, 0);
+	}
+}
+
+static int led_effect_start_locked(struct light_state_t const* state)
+{
+	if (!g_led_effect.curve || !is_lit(state)) {
+		return 0;
+	}
+
+	if (g_led_reset_pending) {
+		g_led_reset_pending = 0;
+		timer_arm(&g_led_reset_timer, 0, 0);
+	}
+	if (g_led_blinking) {
+		write_speaker_light_locked(&g_led_off);
+	}
+
+	g_led_effect.playing = 1;
+	g_led_effect.start = now_ms();
+	led_frame_render_locked();
+	timer_arm(&g_led_frame_timer, LED_FRAME_MS, LED_FRAME_MS);
+	return 1;
+}
+
 static int set_speaker_light_locked(struct light_device_t* dev, struct light_state_t const* state)
 {
 	dump_light_state("attention",    &g_attention);
 	dump_light_state("notification", &g_notification);
 	dump_light_state("battery",      &g_battery);
 
-	if (g_speaker_light.color == state->color) {
-		ALOGV("speaker light color not changed");
+	if (same_light_state(&g_speaker_light, state)) {
+		ALOGV("speaker light not changed");
 		return 0;
 	}
 	g_speaker_light = *state;
 
-	if (is_lit(state)) {
-		// turn off before on to reset timer
-		write_int(LED_RED_FILE, 0);
-		write_int(LED_GREEN_FILE, 0);
-		write_int(LED_BLUE_FILE, 0);
-		write_int(LED_UPDATE_FILE, 1);
-		usleep(100000);
+	led_effect_stop_locked();
+	if (led_effect_start_locked(state)) {
+		return 0;
+	}
+
+	if (is_lit(state) && g_led_reset_timer.fd >= 0) {
+		// turn off before on to reset timer, the worker turns it on
+		if (!g_led_reset_pending) {
+			g_led_reset_pending = 1;
+			timer_arm(&g_led_reset_timer, LED_RESET_MS, 0);
+			return write_speaker_light_locked(&g_led_off);
+		}
+		return 0;
 	}
 
-	write_int(LED_RED_FILE, (state->color >> 16) & 0xFF);
-	write_int(LED_GREEN_FILE, (state->color >> 8) & 0xFF);
-	write_int(LED_BLUE_FILE, state->color & 0xFF);
-	return write_int(LED_UPDATE_FILE, 1);
+	if (g_led_reset_pending) {
+		g_led_reset_pending = 0;
+		timer_arm(&g_led_reset_timer, 0, 0);
+	}
+	return write_speaker_light_locked(state);
 }
 
 static int update_speaker_light_locked(struct light_device_t* dev)
@@ -175,33 +1006,104 @@ static int update_speaker_light_locked(struct light_device_t* dev)
 static int set_light_attention(struct light_device_t* dev, struct light_state_t const* state)
 {
 	ALOGV(__func__);
-	pthread_mutex_lock(&g_lock);
+	stat_inc(&g_stats[TYPE_LED].calls);
+	pthread_mutex_lock(&g_led_lock);
 	g_attention = *state;
 	int ret = update_speaker_light_locked(dev);
-	pthread_mutex_unlock(&g_lock);
+	pthread_mutex_unlock(&g_led_lock);
 	return ret;
 }
 
 static int set_light_notifications(struct light_device_t* dev, struct light_state_t const* state)
 {
 	ALOGV(__func__);
-	pthread_mutex_lock(&g_lock);
+	stat_inc(&g_stats[TYPE_LED].calls);
+	pthread_mutex_lock(&g_led_lock);
 	g_notification = *state;
 	int ret = update_speaker_light_locked(dev);
-	pthread_mutex_unlock(&g_lock);
+	pthread_mutex_unlock(&g_led_lock);
 	return ret;
 }
 
 static int set_light_battery(struct light_device_t* dev, struct light_state_t const* state)
 {
 	ALOGV(__func__);
-	pthread_mutex_lock(&g_lock);
+	stat_inc(&g_stats[TYPE_LED].calls);
+	pthread_mutex_lock(&g_led_lock);
 	g_battery = *state;
 	int ret = update_speaker_light_locked(dev);
-	pthread_mutex_unlock(&g_lock);
+	pthread_mutex_unlock(&g_led_lock);
 	return ret;
 }
 
+static int lights_set_led_effect(pisces_light_device_t *dev __unused, int effect, int period_ms)
+{
+	uint8_t const *curve = NULL;
+	int length = 0;
+
+	switch (effect) {
+	case PISCES_LIGHT_EFFECT_NONE:
+		break;
+	case PISCES_LIGHT_EFFECT_BREATHE:
+	case PISCES_LIGHT_EFFECT_CYCLE:
+		curve = g_breathe_curve;
+		length = sizeof(g_breathe_curve);
+		break;
+	case PISCES_LIGHT_EFFECT_PULSE:
+		curve = g_pulse_curve;
+		length = sizeof(g_pulse_curve);
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (g_led_frame_timer.fd < 0) {
+		return -ENODEV;
+	}
+
+	pthread_mutex_lock(&g_led_lock);
+	led_effect_stop_locked();
+	g_led_effect.effect = effect;
+	g_led_effect.curve = curve;
+	g_led_effect.length = length;
+	g_led_effect.period_ms = period_ms < LED_PERIOD_MIN_MS ? LED_PERIOD_MIN_MS
+		: period_ms > LED_PERIOD_MAX_MS ? LED_PERIOD_MAX_MS : period_ms;
+	g_led_effect.cycle = effect == PISCES_LIGHT_EFFECT_CYCLE;
+	if (!led_effect_start_locked(&g_speaker_light) && !g_led_reset_pending) {
+		/* back to the flash mode set through set_light */
+		write_speaker_light_locked(&g_speaker_light);
+	}
+	pthread_mutex_unlock(&g_led_lock);
+	return 0;
+}
+
+static int lights_dump(pisces_light_device_t *dev __unused, int fd)
+{
+	static const char *const names[TYPE_COUNT] = { "backlight", "buttons", "led" };
+	int type;
+
+	for (type = 0; type < TYPE_COUNT; type++) {
+		struct light_stats *stats = &g_stats[type];
+		uint32_t updates = __atomic_load_n(&stats->updates, __ATOMIC_RELAXED);
+		uint32_t syscalls = __atomic_load_n(&stats->syscalls, __ATOMIC_RELAXED);
+
+		dprintf(fd, "%s:\n", names[type]);
+		dprintf(fd, "  calls: %u\n", __atomic_load_n(&stats->calls, __ATOMIC_RELAXED));
+		dprintf(fd, "  updates: %u\n", updates);
+		dprintf(fd, "  syscalls: %u (%u.%02u per update)\n", syscalls,
+				updates ? syscalls / updates : 0,
+				updates ? syscalls * 100 / updates % 100 : 0);
+		dprintf(fd, "  skipped writes: %u\n", __atomic_load_n(&stats->skipped, __ATOMIC_RELAXED));
+	}
+	dprintf(fd, "button timeout: %d ms\n", g_button_timeout_ms);
+	dprintf(fd, "  user activity calls: %u\n",
+			__atomic_load_n(&g_button_activity_calls, __ATOMIC_RELAXED));
+	dprintf(fd, "led effect: %d, every %d ms\n", g_led_effect.effect, g_led_effect.period_ms);
+	dprintf(fd, "backlight mailbox:\n");
+	dprintf(fd, "  posted: %u\n", __atomic_load_n(&g_backlight_posted, __ATOMIC_RELAXED));
+	dprintf(fd, "  coalesced: %u\n", __atomic_load_n(&g_backlight_coalesced, __ATOMIC_RELAXED));
+	return 0;
+}
+
 static int close_lights(struct light_device_t *dev)
 {
 	if (dev) {
@@ -217,30 +1119,57 @@ static int open_lights(const struct hw_module_t *module, char const *name,
 {
 	int (*set_light)(struct light_device_t *dev,
 		struct light_state_t const *state);
+	int first_node, last_node, node;
+	pthread_mutex_t *lock;
 
 	ALOGV("open_lights: open with %s", name);
 
-	if (0 == strcmp(LIGHT_ID_BACKLIGHT, name))
+	if (0 == strcmp(LIGHT_ID_BACKLIGHT, name)) {
 		set_light = set_light_backlight;
-	else if (0 == strcmp(LIGHT_ID_BUTTONS, name))
+		lock = &g_backlight_lock;
+		first_node = LCD_0;
+		last_node = LCD_1;
+	} else if (0 == strcmp(LIGHT_ID_BUTTONS, name)) {
 		set_light = set_light_buttons;
-    else if (0 == strcmp(LIGHT_ID_ATTENTION, name))
-        set_light = set_light_attention;
-	else if (0 == strcmp(LIGHT_ID_NOTIFICATIONS, name))
+		lock = &g_buttons_lock;
+		first_node = last_node = BUTTON;
+	} else if (0 == strcmp(LIGHT_ID_ATTENTION, name)) {
+		set_light = set_light_attention;
+		lock = &g_led_lock;
+		first_node = LED_RED;
+		last_node = LED_BLUE_TRIGGER;
+	} else if (0 == strcmp(LIGHT_ID_NOTIFICATIONS, name)) {
 		set_light = set_light_notifications;
-	else if (0 == strcmp(LIGHT_ID_BATTERY, name))
+		lock = &g_led_lock;
+		first_node = LED_RED;
+		last_node = LED_BLUE_TRIGGER;
+	} else if (0 == strcmp(LIGHT_ID_BATTERY, name)) {
 		set_light = set_light_battery;
-	else
+		lock = &g_led_lock;
+		first_node = LED_RED;
+		last_node = LED_BLUE_TRIGGER;
+	} else
 		return -EINVAL;
 
-	struct light_device_t *dev = malloc(sizeof(struct light_device_t));
+	pthread_once(&g_init_once, lights_init);
+
+	pthread_mutex_lock(lock);
+	for (node = first_node; node <= last_node; node++)
+		open_node(node);
+	pthread_mutex_unlock(lock);
+
+	pisces_light_device_t *dev = malloc(sizeof(pisces_light_device_t));
 	memset(dev, 0, sizeof(*dev));
 
-	dev->common.tag = HARDWARE_DEVICE_TAG;
-	dev->common.version = 0;
-	dev->common.module = (struct hw_module_t *)module;
-	dev->common.close = (int (*)(struct hw_device_t *))close_lights;
-	dev->set_light = set_light;
+	dev->common.common.tag = HARDWARE_DEVICE_TAG;
+	dev->common.common.version = PISCES_LIGHTS_DEVICE_API_VERSION;
+	dev->common.common.module = (struct hw_module_t *)module;
+	dev->common.common.close = (int (*)(struct hw_device_t *))close_lights;
+	dev->common.set_light = set_light;
+	dev->dump = lights_dump;
+	dev->set_button_timeout = lights_set_button_timeout;
+	dev->user_activity = lights_user_activity;
+	dev->set_led_effect = lights_set_led_effect;
 
 	*device = (struct hw_device_t *)dev;
 	return 0;
@@ -0,0 +1,281 @@
+/*
+ * pre-decoded charger images against their pngs
+ *
+ * for every png/raw pair, decodes the png the way minui does and
+ * checks that the raw spans decode to the same frames, then times
+ * loading both and blitting every frame once, which is what charger
+ * mode does before its first frame. the exit status is non zero on a mismatch
+ */
+#include <fcntl.h>
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <healthd/charger_raw.h>
+
+#define RUNS 20
+
+static int errors;
+
+/* frames of one image, rows of width * 4 bytes */
+struct image {
+	unsigned int width, height, frames;
+	unsigned int row_bytes;
+	unsigned char **data;
+	/* what to release */
+	unsigned char *buf;
+};
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void check(const char *what, int ok)
+{
+	if (!ok) {
+		printf("  FAIL: %s\n", what);
+		errors++;
+	}
+}
+
+/* minui's res_create_multi_display_surface for 8 bit RGB pngs */
+static int load_png(const char *path, struct image *img)
+{
+	png_structp png;
+	png_infop info;
+	png_textp text;
+	unsigned char *row;
+	unsigned int x, y, i;
+	int count;
+	FILE *f = fopen(path, "rb");
+
+	if (!f)
+		return -1;
+	png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info = png_create_info_struct(png);
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(f);
+		return -1;
+	}
+	png_init_io(png, f);
+	png_read_info(png, info);
+	if (png_get_bit_depth(png, info) != 8 ||
+		png_get_color_type(png, info) != PNG_COLOR_TYPE_RGB)
+		png_error(png, "not 8 bit RGB");
+
+	img->frames = 1;
+	count = png_get_text(png, info, &text, NULL);
+	for (i = 0; i < (unsigned int) count; i++)
+		if (!strcmp(text[i].key, "Frames"))
+			img->frames = atoi(text[i].text);
+	img->width = png_get_image_width(png, info);
+	img->height = png_get_image_height(png, info) / img->frames;
+	img->row_bytes = img->width * 4;
+	img->buf = malloc((size_t) img->row_bytes * img->height * img->frames);
+	img->data = malloc(img->frames * sizeof(*img->data));
+	for (i = 0; i < img->frames; i++)
+		img->data[i] = img->buf + (size_t) i * img->row_bytes * img->height;
+
+	row = malloc(img->width * 3);
+	for (y = 0; y < img->height * img->frames; y++) {
+		unsigned char *out = img->data[y % img->frames] +
+				(y / img->frames) * img->row_bytes;
+
+		png_read_row(png, row, NULL);
+		for (x = 0; x < img->width; x++) {
+			out[x * 4] = row[x * 3];
+			out[x * 4 + 1] = row[x * 3 + 1];
+			out[x * 4 + 2] = row[x * 3 + 2];
+			out[x * 4 + 3] = 0xff;
+		}
+	}
+	free(row);
+	png_destroy_read_struct(&png, &info, NULL);
+	fclose(f);
+	return 0;
+}
+
+/* copy the spans of one frame over it, returns where the next frame starts */
+static const unsigned char *decode_frame(const struct charger_raw_header *hdr,
+		const unsigned char *p, const unsigned char *end, unsigned char *frame)
+{
+	struct charger_raw_span span;
+	uint32_t spans;
+
+	if (end - p < (long) sizeof(spans))
+		return NULL;
+	memcpy(&spans, p, sizeof(spans));
+	p += sizeof(spans);
+	while (spans--) {
+		if (end - p < (long) sizeof(span))
+			return NULL;
+		memcpy(&span, p, sizeof(span));
+		p += sizeof(span);
+		if (span.y >= hdr->height || span.x >= hdr->width ||
+			span.count > hdr->width - span.x ||
+			(unsigned long) (end - p) < span.count * 4UL)
+			return NULL;
+		memcpy(frame + ((size_t) span.y * hdr->width + span.x) * 4, p,
+				span.count * 4);
+		p += span.count * 4;
+	}
+	return p;
+}
+
+/* what the charger_raw loader in healthd does */
+static int load_raw(const char *path, struct image *img)
+{
+	struct charger_raw_header hdr;
+	const unsigned char *p, *end;
+	struct stat st;
+	size_t frame_bytes;
+	unsigned int i;
+	void *map;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		hdr.magic != CHARGER_RAW_MAGIC || hdr.version != CHARGER_RAW_VERSION ||
+		hdr.format != CHARGER_RAW_FORMAT_RGBX_8888 || hdr.pixel_bytes != 4 ||
+		hdr.frames == 0 ||
+		hdr.data_offset + (unsigned long long) hdr.data_size > (unsigned long long) st.st_size) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	img->width = hdr.width;
+	img->height = hdr.height;
+	img->row_bytes = hdr.width * 4;
+	img->frames = hdr.frames;
+	frame_bytes = (size_t) img->row_bytes * img->height;
+	img->buf = malloc(frame_bytes * img->frames);
+	img->data = malloc(img->frames * sizeof(*img->data));
+
+	p = (const unsigned char *) map + hdr.data_offset;
+	end = p + hdr.data_size;
+	for (i = 0; p && i < img->frames; i++) {
+		img->data[i] = img->buf + i * frame_bytes;
+		if (i == 0) {
+			uint32_t *px = (uint32_t *) img->data[0];
+			size_t n;
+
+			for (n = 0; n < frame_bytes / 4; n++)
+				px[n] = hdr.background;
+		} else {
+			memcpy(img->data[i], img->data[i - 1], frame_bytes);
+		}
+		p = decode_frame(&hdr, p, end, img->data[i]);
+	}
+	munmap(map, st.st_size);
+	if (!p) {
+		free(img->buf);
+		free(img->data);
+		return -1;
+	}
+	return 0;
+}
+
+static void release(struct image *img)
+{
+	free(img->buf);
+	free(img->data);
+}
+
+/* gr_blit of every frame into a 1080p RGBX framebuffer */
+static void blit_all(const struct image *img)
+{
+	static unsigned char fb[1920 * 1080 * 4];
+	unsigned int i, y;
+
+	for (i = 0; i < img->frames; i++)
+		for (y = 0; y < img->height && y < 1920; y++)
+			memcpy(fb + y * 1080 * 4, img->data[i] + y * img->row_bytes,
+					img->width * 4 < 1080 * 4 ? img->width * 4 : 1080 * 4);
+}
+
+static void time_load(const char *name, const char *path,
+		int (*load)(const char *, struct image *), long long *p50)
+{
+	long long lat[RUNS];
+	struct image img;
+	int i;
+
+	for (i = 0; i < RUNS; i++) {
+		long long t = now_ns();
+		if (load(path, &img)) {
+			check("image loads", 0);
+			return;
+		}
+		blit_all(&img);
+		lat[i] = now_ns() - t;
+		release(&img);
+	}
+	qsort(lat, RUNS, sizeof(lat[0]), cmp_ll);
+	*p50 = lat[RUNS / 2];
+	printf("  %-4s p50 %8.3f ms  max %8.3f ms\n", name, lat[RUNS / 2] / 1e6,
+			lat[RUNS - 1] / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if (argc < 3 || argc % 2 != 1) {
+		fprintf(stderr, "usage: %s <image.png> <image.raw>...\n", argv[0]);
+		return 2;
+	}
+
+	for (i = 1; i < argc; i += 2) {
+		struct image png, raw;
+		long long png_ns = 0, raw_ns = 0;
+		unsigned int f, y, same = 1;
+		struct stat st;
+
+		if (load_png(argv[i], &png) || load_raw(argv[i + 1], &raw)) {
+			fprintf(stderr, "can't load %s or %s\n", argv[i], argv[i + 1]);
+			return 1;
+		}
+		printf("%s: %u frames of %ux%u\n", argv[i], png.frames, png.width, png.height);
+		if (!stat(argv[i + 1], &st))
+			printf("  raw file %lld bytes, decoded %zu\n", (long long) st.st_size,
+					(size_t) png.row_bytes * png.height * png.frames);
+		check("raw image has the png geometry",
+				raw.frames == png.frames && raw.width == png.width &&
+				raw.height == png.height);
+		for (f = 0; same && f < png.frames && f < raw.frames; f++)
+			for (y = 0; same && y < png.height; y++)
+				same = !memcmp(png.data[f] + y * png.row_bytes,
+						raw.data[f] + y * raw.row_bytes, png.width * 4);
+		check("raw frames hold the png pixels", same);
+		release(&png);
+		release(&raw);
+
+		time_load("png", argv[i], load_png, &png_ns);
+		time_load("raw", argv[i + 1], load_raw, &raw_ns);
+		if (raw_ns)
+			printf("  raw loads %.1fx faster\n", (double) png_ns / raw_ns);
+	}
+
+	printf(errors ? "%d checks FAILED\n" : "all checks passed\n", errors);
+	return errors != 0;
+}
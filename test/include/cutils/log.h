@@ -0,0 +1,13 @@
+/*
+ * host stub of the liblog header, just enough to build the
+ * pisces HALs outside of the android tree
+ */
+#ifndef HOST_CUTILS_LOG_H
+#define HOST_CUTILS_LOG_H
+#include <stdio.h>
+#define ALOGE(fmt, ...) fprintf(stderr, "E/" LOG_TAG ": " fmt "\n", ##__VA_ARGS__)
+#define ALOGW(fmt, ...) fprintf(stderr, "W/" LOG_TAG ": " fmt "\n", ##__VA_ARGS__)
+#define ALOGI(fmt, ...) fprintf(stderr, "I/" LOG_TAG ": " fmt "\n", ##__VA_ARGS__)
+#define ALOGD(fmt, ...) do { } while (0)
+#define ALOGV(fmt, ...) do { } while (0)
+#endif
@@ -0,0 +1,8 @@
+/*
+ * host stub of the liblog header, just enough to build the
+ * pisces HALs outside of the android tree
+ */
+#ifndef HOST_UTILS_LOG_H
+#define HOST_UTILS_LOG_H
+#include <cutils/log.h>
+#endif
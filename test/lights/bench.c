@@ -0,0 +1,429 @@
+/*
+ * lights.pisces against a fake sysfs tree
+ *
+ * reports caller side latency and the syscalls each light type took,
+ * with every type called alone and then all of them at once to show
+ * contention between them. after each pass the nodes are read back,
+ * the exit status is non zero if they do not hold the last values set
+ */
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/lights_pisces.h>
+
+#define CALLS 2000
+
+enum {
+	BACKLIGHT,
+	BUTTONS,
+	LED,
+	TYPES,
+};
+
+static const char *const names[TYPES] = { "backlight", "buttons", "led" };
+static const char *const ids[TYPES] = {
+	LIGHT_ID_BACKLIGHT, LIGHT_ID_BUTTONS, LIGHT_ID_NOTIFICATIONS,
+};
+
+static struct light_device_t *lights[TYPES];
+static struct light_device_t *attention;
+static pisces_light_device_t *pdev;
+static const char *root;
+
+static int errors;
+
+/* calls, updates, syscalls, skipped writes of every type, from dump */
+struct stats {
+	unsigned int v[TYPES][4];
+};
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void check(const char *what, int ok)
+{
+	if (!ok) {
+		printf("  FAIL: %s\n", what);
+		errors++;
+	}
+}
+
+static void read_stats(struct stats *s)
+{
+	static const char *const fields[4] = {
+		"  calls: %u", "  updates: %u", "  syscalls: %u", "  skipped writes: %u",
+	};
+	FILE *f = tmpfile();
+	char line[128];
+	int type = -1, i;
+
+	memset(s, 0, sizeof(*s));
+	pdev->dump(pdev, fileno(f));
+	rewind(f);
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] != ' ') {
+			for (type = TYPES - 1; type >= 0; type--)
+				if (!strncmp(line, names[type], strlen(names[type])) && line[strlen(names[type])] == ':')
+					break;
+			continue;
+		}
+		for (i = 0; type >= 0 && i < 4; i++)
+			sscanf(line, fields[i], &s->v[type][i]);
+	}
+	fclose(f);
+}
+
+static int read_node(const char *path)
+{
+	char name[512];
+	int value = -1;
+	FILE *f;
+
+	snprintf(name, sizeof(name), "%s%s", root, path);
+	if ((f = fopen(name, "r"))) {
+		if (fscanf(f, "%d", &value) != 1)
+			value = -1;
+		fclose(f);
+	}
+	return value;
+}
+
+struct pass {
+	int type;
+	int calls;
+	int gap_us;
+	long long lat[CALLS];
+	unsigned int last;
+};
+
+/* gray levels, so every type maps a call to one known value */
+static unsigned int color_of(struct pass *p, int i)
+{
+	unsigned int level = p->type == LED ? 1 + i % 255 : i * 7 % 256;
+	return 0xff000000 | level * 0x010101;
+}
+
+static void *caller(void *arg)
+{
+	struct pass *p = (struct pass *) arg;
+	struct light_device_t *dev = lights[p->type];
+	struct light_state_t state;
+	int i;
+
+	memset(&state, 0, sizeof(state));
+	for (i = 0; i < p->calls; i++) {
+		state.color = p->last = color_of(p, i);
+
+		long long t = now_ns();
+		dev->set_light(dev, &state);
+		p->lat[i] = now_ns() - t;
+
+		if (p->gap_us)
+			usleep(p->gap_us);
+	}
+	return NULL;
+}
+
+/* both banks get the level in lights.c, untrimmed */
+static int bank(int level)
+{
+	return level;
+}
+
+static void check_nodes(struct pass *p)
+{
+	unsigned int level = p->last & 0xff;
+
+	switch (p->type) {
+	case BACKLIGHT:
+		check("backlight banks hold the last brightness",
+				read_node("/sys/class/backlight/lm3533-backlight0/brightness") == bank(level)
+				&& read_node("/sys/class/backlight/lm3533-backlight1/brightness") == bank(level));
+		break;
+	case BUTTONS:
+		check("button node holds the last brightness",
+				read_node("/sys/class/leds/button-backlight/brightness") == (int) level);
+		break;
+	case LED:
+		check("LED channels hold the last color",
+				read_node("/sys/class/leds/red/brightness") == (int) level
+				&& read_node("/sys/class/leds/green/brightness") == (int) level
+				&& read_node("/sys/class/leds/blue/brightness") == (int) level);
+		break;
+	}
+}
+
+/* types[] says which types take part, all of them run at the same time */
+static void run_pass(const char *name, const int *types, int count, int gap_us)
+{
+	static struct pass p[TYPES];
+	pthread_t tid[TYPES];
+	struct stats before, after;
+	int i;
+
+	read_stats(&before);
+	long long start = now_ns();
+	for (i = 0; i < count; i++) {
+		p[i].type = types[i];
+		p[i].calls = CALLS;
+		p[i].gap_us = gap_us;
+		pthread_create(&tid[i], NULL, caller, &p[i]);
+	}
+	for (i = 0; i < count; i++)
+		pthread_join(tid[i], NULL);
+	long long total = now_ns() - start;
+	/* let the workers drain, the LED reset timer is 100 ms */
+	usleep(200000);
+	read_stats(&after);
+
+	printf("%s: %d calls in %.1f ms\n", name, count * CALLS, total / 1e6);
+	for (i = 0; i < count; i++) {
+		unsigned int *a = after.v[p[i].type], *b = before.v[p[i].type];
+		unsigned int updates = a[1] - b[1], syscalls = a[2] - b[2];
+
+		qsort(p[i].lat, CALLS, sizeof(p[i].lat[0]), cmp_ll);
+		printf("  %-9s p50 %6.1f us  p99 %6.1f us  max %7.1f us"
+				"  updates %u  syscalls %u (%.2f per update)  skipped %u\n",
+				names[p[i].type], p[i].lat[CALLS / 2] / 1e3,
+				p[i].lat[CALLS * 99 / 100] / 1e3, p[i].lat[CALLS - 1] / 1e3,
+				updates, syscalls, updates ? (double) syscalls / updates : 0.0, a[3] - b[3]);
+		check_nodes(&p[i]);
+	}
+}
+
+/* the HAL owns the key timeout, the "framework" only reports touches */
+static void run_button_timeout()
+{
+	struct light_device_t *dev = lights[BUTTONS];
+	struct light_state_t state;
+	struct stats before, after;
+	long long lat[CALLS];
+	int i;
+
+	memset(&state, 0, sizeof(state));
+	state.color = 0xff808080;
+	dev->set_light(dev, &state);
+	check("button timeout accepted", pdev->set_button_timeout(pdev, 100) == 0);
+
+	read_stats(&before);
+	for (i = 0; i < CALLS; i++) {
+		long long t = now_ns();
+		pdev->user_activity(pdev);
+		lat[i] = now_ns() - t;
+		usleep(100);
+	}
+	read_stats(&after);
+	check("keys lit during activity",
+			read_node("/sys/class/leds/button-backlight/brightness") == 0x80);
+	usleep(300000);
+	check("keys off after the timeout",
+			read_node("/sys/class/leds/button-backlight/brightness") == 0);
+	pdev->user_activity(pdev);
+	check("keys back on at the next touch",
+			read_node("/sys/class/leds/button-backlight/brightness") == 0x80);
+
+	qsort(lat, CALLS, sizeof(lat[0]), cmp_ll);
+	printf("button timeout: %d touches\n", CALLS);
+	printf("  user_activity p50 %6.1f us  p99 %6.1f us  max %7.1f us  syscalls %u\n",
+			lat[CALLS / 2] / 1e3, lat[CALLS * 99 / 100] / 1e3, lat[CALLS - 1] / 1e3,
+			after.v[BUTTONS][2] - before.v[BUTTONS][2]);
+
+	pdev->set_button_timeout(pdev, 0);
+}
+
+static int read_trigger(const char *path)
+{
+	char name[512], trigger[32] = "";
+	FILE *f;
+
+	snprintf(name, sizeof(name), "%s%s", root, path);
+	if ((f = fopen(name, "r"))) {
+		if (!fgets(trigger, sizeof(trigger), f))
+			trigger[0] = 0;
+		fclose(f);
+	}
+	return !strncmp(trigger, "timer", 5);
+}
+
+/*
+ * LightsService.pulse() and a blinking notification, both on the timer
+ * trigger with LIGHTS_HW_BLINK when the HAL was built to blink there,
+ * else solid
+ */
+static void check_flash(const char *what, struct light_device_t *dev,
+		unsigned int color, int on_ms, int off_ms, const char *led)
+{
+	struct light_state_t state;
+	char trigger[64], brightness[64];
+
+	snprintf(trigger, sizeof(trigger), "/sys/class/leds/%s/trigger", led);
+	snprintf(brightness, sizeof(brightness), "/sys/class/leds/%s/brightness", led);
+
+	memset(&state, 0, sizeof(state));
+	state.color = color;
+	state.flashMode = LIGHT_FLASH_HARDWARE;
+	state.flashOnMS = on_ms;
+	state.flashOffMS = off_ms;
+	dev->set_light(dev, &state);
+	usleep(200000);
+	if (getenv("LIGHTS_HW_BLINK"))
+		check(what, read_trigger(trigger));
+	else
+		check(what, !read_trigger(trigger) && read_node(brightness) == 255);
+
+	memset(&state, 0, sizeof(state));
+	dev->set_light(dev, &state);
+	usleep(200000);
+}
+
+static void run_led_flash()
+{
+	check_flash("attention pulse flashes like any other light", attention,
+			0xffffffff, 7, 1000, "red");
+	check_flash("notification flashes", lights[LED],
+			0xff00ff00, 500, 2000, "green");
+	printf("LED flash: pulse and blink checked, %s\n",
+			getenv("LIGHTS_HW_BLINK") ? "timer trigger" : "solid");
+}
+
+/* brightness levels and colors seen on the LED over ms */
+static void sample_led(int ms, int *levels, int *red, int *green)
+{
+	int seen[256] = { 0 };
+	int t, value;
+
+	*levels = *red = *green = 0;
+	for (t = 0; t < ms; t += 10) {
+		value = read_node("/sys/class/leds/green/brightness");
+		if (value > 0)
+			*green = 1;
+		if (value >= 0 && value < 256 && !seen[value]++)
+			(*levels)++;
+		if (read_node("/sys/class/leds/red/brightness") > 0)
+			*red = 1;
+		usleep(10000);
+	}
+}
+
+/* set_led_effect over a green notification and a red battery light */
+static void run_led_effects()
+{
+	struct light_device_t *led = lights[LED];
+	struct light_device_t *battery;
+	struct light_state_t state;
+	hw_device_t *device;
+	int levels, red, green;
+
+	if (pdev->common.common.module->methods->open(pdev->common.common.module,
+			LIGHT_ID_BATTERY, &device)) {
+		check("battery light opens", 0);
+		return;
+	}
+	battery = (struct light_device_t *) device;
+
+	check("unknown effect rejected", pdev->set_led_effect(pdev, 99, 1000) == -EINVAL);
+
+	memset(&state, 0, sizeof(state));
+	state.color = 0xff00ff00;
+	led->set_light(led, &state);
+	usleep(200000);
+
+	pdev->set_led_effect(pdev, PISCES_LIGHT_EFFECT_BREATHE, 1000);
+	check("breathing starts at once",
+			read_trigger("/sys/class/leds/green/trigger") == 0
+			&& read_node("/sys/class/leds/green/brightness") < 255);
+	sample_led(1000, &levels, &red, &green);
+	check("notification breathes", levels > 10 && !red);
+
+	pdev->set_led_effect(pdev, PISCES_LIGHT_EFFECT_NONE, 0);
+	sample_led(100, &levels, &red, &green);
+	check("no effect leaves the notification solid", levels == 1
+			&& read_node("/sys/class/leds/green/brightness") == 255);
+
+	state.color = 0xffff0000;
+	battery->set_light(battery, &state);
+	pdev->set_led_effect(pdev, PISCES_LIGHT_EFFECT_CYCLE, 500);
+	sample_led(1500, &levels, &red, &green);
+	check("cycling shows notification and battery", red && green);
+
+	memset(&state, 0, sizeof(state));
+	led->set_light(led, &state);
+	battery->set_light(battery, &state);
+	sample_led(100, &levels, &red, &green);
+	check("effect stops with the LED off", levels == 1 && !red && !green);
+	pdev->set_led_effect(pdev, PISCES_LIGHT_EFFECT_NONE, 0);
+	battery->common.close(&battery->common);
+	printf("LED effects: breathe and cycle checked\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *hal = argc > 1 ? argv[1] : "./lights.pisces.so";
+	static const int all[] = { BACKLIGHT, BUTTONS, LED };
+	hw_device_t *device;
+	void *so;
+	int i;
+
+	root = getenv("LIGHTS_SYSFS_ROOT");
+	if (!root) {
+		fprintf(stderr, "LIGHTS_SYSFS_ROOT is not set\n");
+		return 1;
+	}
+	if (!(so = dlopen(hal, RTLD_NOW))) {
+		fprintf(stderr, "%s\n", dlerror());
+		return 1;
+	}
+
+	hw_module_t *module = (hw_module_t *) dlsym(so, HAL_MODULE_INFO_SYM_AS_STR);
+	for (i = 0; i < TYPES; i++) {
+		if (!module || module->methods->open(module, ids[i], &device)) {
+			fprintf(stderr, "can't open %s from %s\n", ids[i], hal);
+			return 1;
+		}
+		lights[i] = (struct light_device_t *) device;
+	}
+	if (lights[0]->common.version < PISCES_LIGHTS_DEVICE_API_VERSION) {
+		fprintf(stderr, "%s has no pisces extensions\n", hal);
+		return 1;
+	}
+	pdev = (pisces_light_device_t *) lights[0];
+	if (module->methods->open(module, LIGHT_ID_ATTENTION, &device)) {
+		fprintf(stderr, "can't open %s from %s\n", LIGHT_ID_ATTENTION, hal);
+		return 1;
+	}
+	attention = (struct light_device_t *) device;
+
+	for (i = 0; i < TYPES; i++)
+		run_pass("alone, back to back", &all[i], 1, 0);
+	run_pass("all types at once, back to back", all, TYPES, 0);
+	run_pass("all types at once, 1 kHz", all, TYPES, 1000);
+	run_button_timeout();
+	run_led_flash();
+	run_led_effects();
+
+	fflush(stdout);
+	pdev->dump(pdev, STDOUT_FILENO);
+
+	for (i = 0; i < TYPES; i++)
+		lights[i]->common.close(&lights[i]->common);
+	attention->common.close(&attention->common);
+
+	printf(errors ? "%d checks FAILED\n" : "all checks passed\n", errors);
+	return errors != 0;
+}
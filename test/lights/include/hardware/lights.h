@@ -0,0 +1,33 @@
+/*
+ * host stub of the libhardware header, just enough to build the
+ * pisces HALs outside of the android tree
+ */
+#ifndef HOST_LIGHTS_H
+#define HOST_LIGHTS_H
+#include <hardware/hardware.h>
+__BEGIN_DECLS
+#define LIGHTS_HARDWARE_MODULE_ID "lights"
+#define LIGHT_ID_BACKLIGHT          "backlight"
+#define LIGHT_ID_KEYBOARD           "keyboard"
+#define LIGHT_ID_BUTTONS            "buttons"
+#define LIGHT_ID_BATTERY            "battery"
+#define LIGHT_ID_NOTIFICATIONS      "notifications"
+#define LIGHT_ID_ATTENTION          "attention"
+#define LIGHT_FLASH_NONE            0
+#define LIGHT_FLASH_TIMED           1
+#define LIGHT_FLASH_HARDWARE        2
+#define BRIGHTNESS_MODE_USER        0
+#define BRIGHTNESS_MODE_SENSOR      1
+struct light_state_t {
+    unsigned int color;
+    int flashMode;
+    int flashOnMS;
+    int flashOffMS;
+    int brightnessMode;
+};
+struct light_device_t {
+    struct hw_device_t common;
+    int (*set_light)(struct light_device_t* dev, struct light_state_t const* state);
+};
+__END_DECLS
+#endif
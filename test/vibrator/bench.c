@@ -0,0 +1,241 @@
+/*
+ * vibrator.pisces against the stub libImmVibeJ.so
+ *
+ * reports caller side latency of vibrator_on/vibrator_off for keyboard
+ * style feedback from one and from several threads, with immvibed up and
+ * while it restarts, plus how many requests reached the stub. after each
+ * pass the device handle state of the stub is checked, the exit status
+ * is non zero if the HAL misused it
+ */
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/vibrator_pisces.h>
+
+#define THREADS 4
+#define KEYS    2000
+
+static vibrator_device_t *vib;
+static pisces_vibrator_device_t *pdev;
+
+static unsigned int *calls, *failed, *plays, *stops, *violations;
+static void (*stub_kill_daemon)(int down_ms);
+static int (*stub_device_open)();
+static int (*stub_initialized)();
+
+static int errors;
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+struct pass {
+	const char *name;
+	int keys;
+	int gap_us;
+	long long *lat;
+	int n;
+};
+
+static void *keyboard(void *arg)
+{
+	struct pass *p = (struct pass *) arg;
+	int i;
+
+	for (i = 0; i < p->keys; i++) {
+		long long t = now_ns();
+		vib->vibrator_off(vib);
+		p->lat[p->n++] = now_ns() - t;
+
+		t = now_ns();
+		vib->vibrator_on(vib, 20);
+		p->lat[p->n++] = now_ns() - t;
+
+		if (p->gap_us)
+			usleep(p->gap_us);
+	}
+	return NULL;
+}
+
+static void check(const char *what, int ok)
+{
+	if (!ok) {
+		printf("  FAIL: %s\n", what);
+		errors++;
+	}
+}
+
+static void check_handle(int expect_open)
+{
+	check("device handle state", stub_device_open() == expect_open
+			&& stub_initialized() == expect_open);
+	check("no misuse of the ImmVibe API", *violations == 0);
+}
+
+static void run_pass(const char *name, int threads, int keys, int gap_us)
+{
+	static long long lat[THREADS * KEYS * 2];
+	struct pass p[THREADS];
+	pthread_t tid[THREADS];
+	unsigned int calls0 = *calls, failed0 = *failed, plays0 = *plays, stops0 = *stops;
+	int i, n = 0;
+
+	long long start = now_ns();
+	for (i = 0; i < threads; i++) {
+		p[i].keys = keys;
+		p[i].gap_us = gap_us;
+		p[i].lat = lat + i * KEYS * 2;
+		p[i].n = 0;
+		pthread_create(&tid[i], NULL, keyboard, &p[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(tid[i], NULL);
+		/* pack the samples */
+		memmove(lat + n, p[i].lat, p[i].n * sizeof(lat[0]));
+		n += p[i].n;
+	}
+	long long total = now_ns() - start;
+	/* let the worker drain */
+	usleep(50000);
+
+	qsort(lat, n, sizeof(lat[0]), cmp_ll);
+	printf("%s: %d threads, %d calls in %.1f ms\n", name, threads, n, total / 1e6);
+	printf("  caller latency: p50 %.1f us  p99 %.1f us  max %.1f us\n",
+			lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3);
+	printf("  immvibe calls %u (failed %u, plays %u, stops %u)\n",
+			*calls - calls0, *failed - failed0, *plays - plays0, *stops - stops0);
+}
+
+static void run_pattern()
+{
+	/* ramp up, buzz, fade out; twice */
+	static const pisces_vibrator_segment_t segments[] = {
+		{ 30, 80 }, { 30, 160 }, { 200, 255 }, { 40, 120 }, { 150, 0 },
+		{ 30, 80 }, { 30, 160 }, { 200, 255 }, { 40, 120 }, { 150, 0 },
+	};
+	unsigned int count = sizeof(segments) / sizeof(segments[0]);
+	unsigned int calls0 = *calls, plays0 = *plays;
+
+	long long t = now_ns();
+	check("play_pattern", pdev->play_pattern(pdev, segments, count, -1) == 0);
+	t = now_ns() - t;
+	usleep(1000000);
+
+	printf("pattern: %u segments, caller latency %.1f us\n", count, t / 1e3);
+	printf("  immvibe calls %u (plays %u)\n", *calls - calls0, *plays - plays0);
+}
+
+/* an off during the backoff still has to end a repeating pattern */
+static void run_pattern_outage()
+{
+	static const pisces_vibrator_segment_t segments[] = {
+		{ 100, 255 }, { 100, 0 },
+	};
+	unsigned int plays0;
+
+	check("play_pattern", pdev->play_pattern(pdev, segments, 2, 0) == 0);
+	usleep(300000);
+	stub_kill_daemon(1500);
+	usleep(500000);
+	vib->vibrator_off(vib);
+	usleep(2000000);
+	plays0 = *plays;
+	usleep(1000000);
+
+	printf("pattern off during an outage: %u plays after the off\n", *plays - plays0);
+	check("pattern stopped by an off while backing off", *plays == plays0);
+}
+
+static void run_effects()
+{
+	unsigned int calls0 = *calls, plays0 = *plays;
+	int rc = pdev->play_effect(pdev, PISCES_VIBRATOR_EFFECT_DOUBLE_CLICK);
+
+	usleep(200000);
+	if (rc == -ENOTSUP) {
+		printf("effects: no IVT effect library\n");
+		return;
+	}
+	check("play_effect", rc == 0);
+	vib->vibrator_on(vib, 22);
+	usleep(100000);
+	printf("effects: double click + 22 ms on\n");
+	printf("  immvibe calls %u (plays %u)\n", *calls - calls0, *plays - plays0);
+}
+
+int main(int argc, char **argv)
+{
+	const char *hal = argc > 1 ? argv[1] : "./vibrator.pisces.so";
+	hw_device_t *device;
+	void *so, *stub;
+
+	if (!(so = dlopen(hal, RTLD_NOW)) || !(stub = dlopen("libImmVibeJ.so", RTLD_NOW))) {
+		fprintf(stderr, "%s\n", dlerror());
+		return 1;
+	}
+	calls = (unsigned int *) dlsym(stub, "stub_calls");
+	failed = (unsigned int *) dlsym(stub, "stub_failed");
+	plays = (unsigned int *) dlsym(stub, "stub_plays");
+	stops = (unsigned int *) dlsym(stub, "stub_stops");
+	violations = (unsigned int *) dlsym(stub, "stub_violations");
+	stub_kill_daemon = (void (*)(int)) dlsym(stub, "stub_kill_daemon");
+	stub_device_open = (int (*)()) dlsym(stub, "stub_device_open");
+	stub_initialized = (int (*)()) dlsym(stub, "stub_initialized");
+
+	hw_module_t *module = (hw_module_t *) dlsym(so, HAL_MODULE_INFO_SYM_AS_STR);
+	if (!module || module->methods->open(module, VIBRATOR_DEVICE_ID_MAIN, &device)) {
+		fprintf(stderr, "can't open %s\n", hal);
+		return 1;
+	}
+	vib = (vibrator_device_t *) device;
+	if (vib->common.version < PISCES_VIBRATOR_DEVICE_API_VERSION) {
+		fprintf(stderr, "%s has no pisces extensions\n", hal);
+		return 1;
+	}
+	pdev = (pisces_vibrator_device_t *) vib;
+	check_handle(1);
+
+	run_pass("back to back", 1, KEYS, 0);
+	check_handle(1);
+	run_pass("typing, 5 ms per key", 1, KEYS / 4, 5000);
+	check_handle(1);
+	run_pass("typing, 1 ms per key", THREADS, KEYS / 4, 1000);
+	check_handle(1);
+
+	run_pattern();
+	run_effects();
+	check_handle(1);
+
+	/* immvibed restarts for 300 ms while the keys keep coming */
+	stub_kill_daemon(300);
+	run_pass("immvibed restarting", THREADS, KEYS / 8, 1000);
+	usleep(1000000);
+	check_handle(1);
+
+	run_pattern_outage();
+	check_handle(1);
+
+	fflush(stdout);
+	pdev->dump(pdev, STDOUT_FILENO);
+
+	device->close(device);
+	check_handle(0);
+
+	printf(errors ? "%d checks FAILED\n" : "all checks passed\n", errors);
+	return errors != 0;
+}
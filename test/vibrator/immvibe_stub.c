@@ -0,0 +1,295 @@
+/*
+ * stand-in for the proprietary libImmVibeJ.so
+ *
+ * every call sleeps for the simulated binder round trip to immvibed
+ * (IMMVIBE_STUB_LATENCY_US, default 1000) and is counted, so the
+ * benchmark can tell how many requests actually reached the "daemon".
+ *
+ * failure injection: every IMMVIBE_STUB_FAIL_EVERY-th call fails, and
+ * stub_kill_daemon() makes all calls fail for a while like a restarting
+ * immvibed would.
+ *
+ * the stub also checks how the HAL uses it: overlapping calls, calls
+ * with a stale device handle, opening a second handle or playing before
+ * initialize are all counted as violations.
+ *
+ * IVT "files" are text, one "name duration_ms" per line.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VIBE_S_SUCCESS                0
+#define VIBE_E_NOT_INITIALIZED       -2
+#define VIBE_E_INVALID_ARGUMENT      -3
+#define VIBE_E_SERVICE_NOT_RUNNING  -10
+
+#define STUB_DEVICE_HANDLE 0x1234
+
+static int latency_us = -1;
+static int fail_every;
+static long long down_until_ms;
+
+static int initialized;
+static int32_t open_handle;
+static int in_flight;
+
+unsigned int stub_calls;
+unsigned int stub_failed;
+unsigned int stub_plays;
+unsigned int stub_stops;
+unsigned int stub_violations;
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void violation(const char *what)
+{
+	__atomic_add_fetch(&stub_violations, 1, __ATOMIC_RELAXED);
+	fprintf(stderr, "stub: %s\n", what);
+}
+
+void stub_configure(int latency, int every)
+{
+	latency_us = latency;
+	fail_every = every;
+}
+
+void stub_kill_daemon(int down_ms)
+{
+	__atomic_store_n(&down_until_ms, now_ms() + down_ms, __ATOMIC_RELAXED);
+}
+
+int stub_device_open()
+{
+	return open_handle != 0;
+}
+
+int stub_initialized()
+{
+	return initialized;
+}
+
+/* returns non zero if this call fails */
+static int stub_enter()
+{
+	unsigned int n;
+
+	if (latency_us < 0) {
+		const char *env = getenv("IMMVIBE_STUB_LATENCY_US");
+		latency_us = env ? atoi(env) : 1000;
+		env = getenv("IMMVIBE_STUB_FAIL_EVERY");
+		fail_every = env ? atoi(env) : 0;
+	}
+	if (__atomic_add_fetch(&in_flight, 1, __ATOMIC_ACQUIRE) != 1) {
+		violation("overlapping calls");
+	}
+	n = __atomic_add_fetch(&stub_calls, 1, __ATOMIC_RELAXED);
+	if (latency_us > 0) {
+		usleep(latency_us);
+	}
+	if ((fail_every && n % fail_every == 0)
+			|| now_ms() < __atomic_load_n(&down_until_ms, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&stub_failed, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+static void stub_leave()
+{
+	__atomic_sub_fetch(&in_flight, 1, __ATOMIC_RELEASE);
+}
+
+static int32_t stub_check_device(int32_t hDeviceHandle)
+{
+	if (!initialized) {
+		violation("device call before initialize");
+		return VIBE_E_NOT_INITIALIZED;
+	}
+	if (!open_handle || hDeviceHandle != open_handle) {
+		violation("stale device handle");
+		return VIBE_E_INVALID_ARGUMENT;
+	}
+	return VIBE_S_SUCCESS;
+}
+
+int32_t ImmVibeInitialize(int32_t nVersion)
+{
+	int32_t vs = VIBE_S_SUCCESS;
+
+	(void) nVersion;
+	if (stub_enter()) {
+		vs = VIBE_E_SERVICE_NOT_RUNNING;
+	} else {
+		initialized = 1;
+	}
+	stub_leave();
+	return vs;
+}
+
+int32_t ImmVibeTerminate(void)
+{
+	stub_enter();
+	if (!initialized) {
+		violation("terminate without initialize");
+	}
+	if (open_handle) {
+		violation("terminate with device still open");
+	}
+	initialized = 0;
+	stub_leave();
+	return VIBE_S_SUCCESS;
+}
+
+int32_t ImmVibeOpenDevice(int32_t nDeviceIndex, int32_t *phDeviceHandle)
+{
+	int32_t vs = VIBE_S_SUCCESS;
+
+	(void) nDeviceIndex;
+	if (stub_enter()) {
+		vs = VIBE_E_SERVICE_NOT_RUNNING;
+	} else if (!initialized) {
+		violation("open before initialize");
+		vs = VIBE_E_NOT_INITIALIZED;
+	} else {
+		if (open_handle) {
+			violation("second device handle");
+		}
+		/* a fresh handle each time, so stale ones are caught */
+		open_handle = STUB_DEVICE_HANDLE + (open_handle & 0xff) + 1;
+		*phDeviceHandle = open_handle;
+	}
+	stub_leave();
+	return vs;
+}
+
+int32_t ImmVibeCloseDevice(int32_t hDeviceHandle)
+{
+	int32_t vs;
+
+	/* closing always works, even if the daemon is gone */
+	stub_enter();
+	if (!(vs = stub_check_device(hDeviceHandle))) {
+		open_handle = 0;
+	}
+	stub_leave();
+	return vs;
+}
+
+int32_t ImmVibePlayMagSweepEffect(int32_t hDeviceHandle, int32_t nDuration,
+		int32_t nMagnitude, int32_t nStyle, int32_t nAttackTime, int32_t nAttackLevel,
+		int32_t nFadeTime, int32_t nFadeLevel, int32_t *phEffectHandle)
+{
+	int32_t vs;
+
+	(void) nDuration; (void) nMagnitude; (void) nStyle; (void) nAttackTime;
+	(void) nAttackLevel; (void) nFadeTime; (void) nFadeLevel;
+	if (stub_enter()) {
+		vs = VIBE_E_SERVICE_NOT_RUNNING;
+	} else if (!(vs = stub_check_device(hDeviceHandle))) {
+		__atomic_add_fetch(&stub_plays, 1, __ATOMIC_RELAXED);
+		*phEffectHandle = 1;
+	}
+	stub_leave();
+	return vs;
+}
+
+int32_t ImmVibeStopAllPlayingEffects(int32_t hDeviceHandle)
+{
+	int32_t vs;
+
+	if (stub_enter()) {
+		vs = VIBE_E_SERVICE_NOT_RUNNING;
+	} else if (!(vs = stub_check_device(hDeviceHandle))) {
+		__atomic_add_fetch(&stub_stops, 1, __ATOMIC_RELAXED);
+	}
+	stub_leave();
+	return vs;
+}
+
+int32_t ImmVibeSetDevicePropertyInt32(int32_t hDeviceHandle, int32_t nDevPropType,
+		int32_t nDevPropValue)
+{
+	int32_t vs;
+
+	(void) nDevPropType; (void) nDevPropValue;
+	if (stub_enter()) {
+		vs = VIBE_E_SERVICE_NOT_RUNNING;
+	} else {
+		vs = stub_check_device(hDeviceHandle);
+	}
+	stub_leave();
+	return vs;
+}
+
+int32_t ImmVibePlayIVTEffect(int32_t hDeviceHandle, const uint8_t *pIVT,
+		int32_t nEffectIndex, int32_t *phEffectHandle)
+{
+	int32_t vs;
+
+	(void) pIVT; (void) nEffectIndex;
+	if (stub_enter()) {
+		vs = VIBE_E_SERVICE_NOT_RUNNING;
+	} else if (!(vs = stub_check_device(hDeviceHandle))) {
+		__atomic_add_fetch(&stub_plays, 1, __ATOMIC_RELAXED);
+		*phEffectHandle = 1;
+	}
+	stub_leave();
+	return vs;
+}
+
+/* the IVT queries are local to the library, no round trip */
+static const char *ivt_line(const uint8_t *pIVT, int32_t index)
+{
+	const char *line = (const char *) pIVT;
+
+	while (index-- > 0 && line) {
+		if ((line = strchr(line, '\n')))
+			line++;
+	}
+	return line && *line ? line : NULL;
+}
+
+int32_t ImmVibeGetIVTEffectCount(const uint8_t *pIVT)
+{
+	int32_t count = 0;
+
+	while (ivt_line(pIVT, count))
+		count++;
+	return count;
+}
+
+int32_t ImmVibeGetIVTEffectDuration(const uint8_t *pIVT, int32_t nEffectIndex,
+		int32_t *pnEffectDuration)
+{
+	const char *line = ivt_line(pIVT, nEffectIndex);
+
+	if (!line || !(line = strchr(line, ' ')))
+		return VIBE_E_INVALID_ARGUMENT;
+	*pnEffectDuration = atoi(line);
+	return VIBE_S_SUCCESS;
+}
+
+int32_t ImmVibeGetIVTEffectIndexFromName(const uint8_t *pIVT, const char *szEffectName,
+		int32_t *pnEffectIndex)
+{
+	size_t len = strlen(szEffectName);
+	const char *line;
+	int32_t i;
+
+	for (i = 0; (line = ivt_line(pIVT, i)); i++) {
+		if (!strncmp(line, szEffectName, len) && line[len] == ' ') {
+			*pnEffectIndex = i;
+			return VIBE_S_SUCCESS;
+		}
+	}
+	return VIBE_E_INVALID_ARGUMENT;
+}
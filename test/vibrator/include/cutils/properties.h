@@ -0,0 +1,26 @@
+/*
+ * host stub of the libcutils header, just enough to build the
+ * pisces HALs outside of the android tree
+ */
+#ifndef HOST_PROPERTIES_H
+#define HOST_PROPERTIES_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#define PROPERTY_KEY_MAX 32
+#define PROPERTY_VALUE_MAX 92
+#define PROP_VALUE_MAX 92
+static inline int property_get(const char *key, char *value, const char *default_value)
+{
+	const char *v = getenv(key);
+	if (!v) v = default_value ? default_value : "";
+	strncpy(value, v, PROPERTY_VALUE_MAX - 1);
+	value[PROPERTY_VALUE_MAX - 1] = 0;
+	return strlen(value);
+}
+static inline int32_t property_get_int32(const char *key, int32_t def)
+{
+	const char *v = getenv(key);
+	return v ? atoi(v) : def;
+}
+#endif
@@ -0,0 +1,19 @@
+/*
+ * host stub of the libhardware header, just enough to build the
+ * pisces HALs outside of the android tree
+ */
+#ifndef HOST_VIBRATOR_H
+#define HOST_VIBRATOR_H
+#include <hardware/hardware.h>
+__BEGIN_DECLS
+#define VIBRATOR_API_VERSION HARDWARE_MODULE_API_VERSION(1,0)
+#define VIBRATOR_HARDWARE_MODULE_ID "vibrator"
+#define VIBRATOR_DEVICE_ID_MAIN "main_vibrator"
+struct vibrator_device;
+typedef struct vibrator_device {
+    struct hw_device_t common;
+    int (*vibrator_on)(struct vibrator_device* vibradev, unsigned int timeout_ms);
+    int (*vibrator_off)(struct vibrator_device* vibradev);
+} vibrator_device_t;
+__END_DECLS
+#endif
@@ -0,0 +1,37 @@
+/*
+ * host stub of the bionic header, just enough to build the
+ * pisces HALs outside of the android tree
+ *
+ * properties come from the environment and never change serial
+ */
+#ifndef HOST_SYSTEM_PROPERTIES_H
+#define HOST_SYSTEM_PROPERTIES_H
+#include <stdlib.h>
+#include <string.h>
+#include <cutils/properties.h>
+
+typedef struct prop_info prop_info;
+
+static inline unsigned int __system_property_area_serial(void)
+{
+	return 1;
+}
+
+static inline const prop_info *__system_property_find(const char *name)
+{
+	return (const prop_info *) getenv(name);
+}
+
+static inline unsigned int __system_property_serial(const prop_info *pi)
+{
+	return pi ? 2 : 0;
+}
+
+static inline int __system_property_read(const prop_info *pi, char *name, char *value)
+{
+	(void) name;
+	strncpy(value, (const char *) pi, PROP_VALUE_MAX - 1);
+	value[PROP_VALUE_MAX - 1] = 0;
+	return strlen(value);
+}
+#endif
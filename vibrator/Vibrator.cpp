@@ -16,12 +16,18 @@
  */
  
 #include <hardware/vibrator.h>
+#include <hardware/vibrator_pisces.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/futex.h>
 
 #include "stdio.h"
 #include "string.h"
@@ -31,6 +37,8 @@
 #define LOG_TAG "Vibrator"
 #include <utils/Log.h>
 #include <cutils/properties.h>
+#define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
+#include <sys/_system_properties.h>
 
 // copy from api
 #include <sys/types.h>
@@ -64,6 +72,9 @@ typedef unsigned short                  VibeWChar;
 #define VIBE_MAX_EFFECT_NAME_LENGTH                 128   /*!< Maximum effect name length */
 #define VIBE_INVALID_INDEX                          -1    /*!< Invalid Index */
 
+/* Device property types */
+#define VIBE_DEVPROPTYPE_STRENGTH                   3   /*!< Strength (volume) applied to all effects */
+
 /* Periodic, MagSweep effect Styles */
 #define VIBE_STYLE_SMOOTH                           0   /*!< "Smooth" style */
 #define VIBE_STYLE_STRONG                           1   /*!< "Strong" style */
@@ -135,6 +146,40 @@ IMMVIBEAPI(VibeStatus, ImmVibeStopAllPlayingEffects)
 	IN VibeInt32 hDeviceHandle
 );
 
+IMMVIBEAPI(VibeStatus, ImmVibeSetDevicePropertyInt32)
+(
+	IN VibeInt32 hDeviceHandle,
+	IN VibeInt32 nDevPropType,
+	IN VibeInt32 nDevPropValue
+);
+
+IMMVIBEAPI(VibeStatus, ImmVibePlayIVTEffect)
+(
+	IN VibeInt32 hDeviceHandle,
+	IN const VibeUInt8 *pIVT,
+	IN VibeInt32 nEffectIndex,
+	OUT VibeInt32 *phEffectHandle
+);
+
+IMMVIBEAPI(VibeStatus, ImmVibeGetIVTEffectCount)
+(
+	IN const VibeUInt8 *pIVT
+);
+
+IMMVIBEAPI(VibeStatus, ImmVibeGetIVTEffectDuration)
+(
+	IN const VibeUInt8 *pIVT,
+	IN VibeInt32 nEffectIndex,
+	OUT VibeInt32 *pnEffectDuration
+);
+
+IMMVIBEAPI(VibeStatus, ImmVibeGetIVTEffectIndexFromName)
+(
+	IN const VibeUInt8 *pIVT,
+	IN const char *szEffectName,
+	OUT VibeInt32 *pnEffectIndex
+);
+
 #define DoWithImmSymbols(action) \
 	action(ImmVibeInitialize); \
 	action(ImmVibeTerminate); \
@@ -143,14 +188,23 @@ IMMVIBEAPI(VibeStatus, ImmVibeStopAllPlayingEffects)
 	action(ImmVibePlayMagSweepEffect); \
 	action(ImmVibeStopAllPlayingEffects);
 
+/* the HAL works without these, they just enable the IVT effect library */
+#define DoWithOptionalImmSymbols(action) \
+	action(ImmVibeSetDevicePropertyInt32); \
+	action(ImmVibePlayIVTEffect); \
+	action(ImmVibeGetIVTEffectCount); \
+	action(ImmVibeGetIVTEffectDuration); \
+	action(ImmVibeGetIVTEffectIndexFromName);
+
 #define define_symbol(name) static name##_t name
 DoWithImmSymbols(define_symbol)
+DoWithOptionalImmSymbols(define_symbol)
 #undef define_symbol
 
 static void *libImmVibeJ_so_handle;
 static void libImmVibeJ_init()
 {
-	if (!(libImmVibeJ_so_handle = dlopen("libImmVibeJ.so", RTLD_LOCAL))) {
+	if (!(libImmVibeJ_so_handle = dlopen("libImmVibeJ.so", RTLD_NOW | RTLD_LOCAL))) {
 		ALOGE("error opening libImmVibeJ.so");
 		goto err;
 	}
@@ -164,23 +218,92 @@ static void libImmVibeJ_init()
 
 	DoWithImmSymbols(load_symbol)
 #undef load_symbol
+
+#define load_optional_symbol(name) \
+	name = (name##_t) dlsym(libImmVibeJ_so_handle, #name)
+	DoWithOptionalImmSymbols(load_optional_symbol)
+#undef load_optional_symbol
 	return;
 
 err:
 #define clear_symbol(name) name = NULL
 	DoWithImmSymbols(clear_symbol)
+	DoWithOptionalImmSymbols(clear_symbol)
 #undef clear_symbol
 }
 
 static VibeInt32 devHandle = VIBE_INVALID_DEVICE_HANDLE_VALUE;
 static int immVibeInitialized = 0;
+/* device strength set on the current connection, -1 if none */
+static VibeInt32 strength = -1;
+
+static int64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t now_ms()
+{
+	return now_us() / 1000;
+}
+
+/*
+ * when immvibed goes away every ImmVibe call fails, and re-initializing
+ * for each request just stalls on the dead daemon. after a failure stay
+ * in CONN_BACKOFF, drop requests, and let the worker retry with an
+ * exponential backoff
+ */
+enum conn_state {
+	CONN_DOWN,
+	CONN_UP,
+	CONN_BACKOFF,
+};
+
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 10000
+
+static int connState = CONN_DOWN;
+static int64_t retryAt;
+static int backoffMs = BACKOFF_MIN_MS;
+
+/* read by vibra_dump from any thread */
+static uint32_t statRequests;
+static uint32_t statDropped;
+static uint32_t statFailures;
+static uint32_t statReconnects;
+
+static void stat_inc(uint32_t *stat)
+{
+	__atomic_add_fetch(stat, 1, __ATOMIC_RELAXED);
+}
 
 static void vibrate_terminate();
+static void vibrate_failed()
+{
+	vibrate_terminate();
+
+	stat_inc(&statFailures);
+	retryAt = now_ms() + backoffMs;
+	ALOGW("ImmVibe connection lost, retrying in %d ms", backoffMs);
+	backoffMs = backoffMs * 2 > BACKOFF_MAX_MS ? BACKOFF_MAX_MS : backoffMs * 2;
+	__atomic_store_n(&connState, CONN_BACKOFF, __ATOMIC_RELEASE);
+}
+
 static VibeStatus vibrate_init()
 {
+	if (connState == CONN_UP) {
+		return VIBE_S_SUCCESS;
+	}
+	if (connState == CONN_BACKOFF && now_ms() < retryAt) {
+		return VIBE_E_SERVICE_NOT_RUNNING;
+	}
+
 	if (!ImmVibeInitialize) {
 		libImmVibeJ_init();
 		if (!ImmVibeInitialize) {
+			vibrate_failed();
 			return VIBE_E_NOT_INITIALIZED;
 		}
 	}
@@ -194,6 +317,7 @@ static VibeStatus vibrate_init()
 			if (vs == VIBE_E_INVALID_ARGUMENT) {
 				ALOGE("Version number do not match");
 			}
+			vibrate_failed();
 			return vs;
 		}
 		immVibeInitialized = 1;
@@ -205,10 +329,16 @@ static VibeStatus vibrate_init()
 
 		if (VIBE_FAILED(vs)) {
 			ALOGE("Open device Failed, status=%d", (int) vs);
-			vibrate_terminate();
+			vibrate_failed();
 			return vs;
 		}
 	}
+
+	if (connState == CONN_BACKOFF) {
+		stat_inc(&statReconnects);
+	}
+	backoffMs = BACKOFF_MIN_MS;
+	__atomic_store_n(&connState, CONN_UP, __ATOMIC_RELEASE);
 	return vs;
 }
 
@@ -223,28 +353,132 @@ static void vibrate_terminate()
 		ImmVibeTerminate();
 		immVibeInitialized = 0;
 	}
+	strength = -1;
+	connState = CONN_DOWN;
 }
 
-static VibeStatus vibrate_on(int duration)
+#define INTENSITY_PROPERTY "persist.vibrator_intensity"
+#define INTENSITY_DEFAULT  5000
+
+static const prop_info *intensityProp;
+static unsigned int intensitySerial;
+static unsigned int intensityAreaSerial;
+static VibeInt32 intensity = INTENSITY_DEFAULT;
+/* intensity at the minimum, kept for vibrate_dropped on the binder threads */
+static int intensityMuted = INTENSITY_DEFAULT <= VIBE_MIN_MAGNITUDE;
+
+/*
+ * the intensity only changes when VibratorHW.setIntensity is called,
+ * parse it once per change and only compare serials when vibrating
+ */
+static VibeInt32 vibrate_intensity()
+{
+	if (!intensityProp) {
+		/* not set yet, look it up again only after some property changed */
+		unsigned int areaSerial = __system_property_area_serial();
+		if (areaSerial == intensityAreaSerial) {
+			return intensity;
+		}
+		intensityAreaSerial = areaSerial;
+
+		intensityProp = __system_property_find(INTENSITY_PROPERTY);
+		if (!intensityProp) {
+			return intensity;
+		}
+	}
+
+	unsigned int serial = __system_property_serial(intensityProp);
+	if (serial != intensitySerial) {
+		char value[PROP_VALUE_MAX];
+		char *end;
+
+		intensitySerial = serial;
+		__system_property_read(intensityProp, NULL, value);
+
+		long parsed = strtol(value, &end, 10);
+		if (end == value || *end) {
+			parsed = INTENSITY_DEFAULT;
+		} else if (parsed < VIBE_MIN_MAGNITUDE) {
+			parsed = VIBE_MIN_MAGNITUDE;
+		} else if (parsed > VIBE_MAX_MAGNITUDE) {
+			parsed = VIBE_MAX_MAGNITUDE;
+		}
+		intensity = (VibeInt32) parsed;
+		__atomic_store_n(&intensityMuted, intensity <= VIBE_MIN_MAGNITUDE, __ATOMIC_RELAXED);
+		ALOGV("intensity changed to %d", (int) intensity);
+	}
+	return intensity;
+}
+
+static int strengthUnsupported;
+
+/*
+ * with the device strength following the user intensity, IVT effects
+ * follow it too and MagSweep can use full scale magnitudes. only when
+ * that is not supported the magnitudes are scaled instead
+ */
+static VibeInt32 vibrate_scale()
+{
+	VibeInt32 want = vibrate_intensity();
+
+	if (want != strength && ImmVibeSetDevicePropertyInt32 && !strengthUnsupported) {
+		VibeStatus vs = ImmVibeSetDevicePropertyInt32(devHandle, VIBE_DEVPROPTYPE_STRENGTH, want);
+		if (VIBE_SUCCEEDED(vs)) {
+			strength = want;
+		} else if (vs == VIBE_E_NOT_SUPPORTED || vs == VIBE_E_INCOMPATIBLE_PROPERTY_TYPE
+				|| vs == VIBE_E_INVALID_ARGUMENT) {
+			ALOGW("device strength not supported, status=%d", (int) vs);
+			strengthUnsupported = 1;
+		}
+	}
+	return strength == want ? VIBE_MAX_MAGNITUDE : want;
+}
+
+/* levels are 0-255 here and scaled to the user intensity */
+struct vibra_effect {
+	int32_t at;             /* ms from the start of the pattern */
+	int32_t duration;
+	int32_t level;
+	int32_t attackTime;
+	int32_t attackLevel;
+	int32_t fadeTime;
+	int32_t fadeLevel;
+};
+
+static VibeStatus vibrate_play(const struct vibra_effect *e)
 {
 	VibeInt32 effectHandle;
+	VibeInt32 scale = vibrate_scale();
 
-	int32_t intensity = property_get_int32("persist.vibrator_intensity", 5000);
-	VibeStatus vs = ImmVibePlayMagSweepEffect(devHandle, duration, intensity, VIBE_STYLE_STRONG, 0, 0, 0, 0, &effectHandle);
+	VibeStatus vs = ImmVibePlayMagSweepEffect(devHandle, e->duration,
+			e->level * scale / PISCES_VIBRATOR_MAX_AMPLITUDE, VIBE_STYLE_STRONG,
+			e->attackTime, e->attackLevel * scale / PISCES_VIBRATOR_MAX_AMPLITUDE,
+			e->fadeTime, e->fadeLevel * scale / PISCES_VIBRATOR_MAX_AMPLITUDE,
+			&effectHandle);
 	if (VIBE_FAILED(vs)) {
 		ALOGE("ImmVibePlayMagSweepEffect failed, status=%d", (int) vs);
-		vibrate_terminate();
+		vibrate_failed();
 	}
 	return vs;
 }
 
+static VibeStatus vibrate_on(int duration)
+{
+	struct vibra_effect e;
+
+	memset(&e, 0, sizeof(e));
+	e.duration = duration;
+	e.level = PISCES_VIBRATOR_MAX_AMPLITUDE;
+	return vibrate_play(&e);
+}
+
 static VibeStatus vibrate_off()
 {
 	ALOGV("Stopping");
 	VibeStatus vs = ImmVibeStopAllPlayingEffects(devHandle);
 	if (VIBE_FAILED(vs)) {
 		ALOGE("ImmVibeStopAllPlayingEffects failed, status=%d", (int) vs);
-		vibrate_terminate();
+		vibrate_failed();
 	}
 	return vs;
 }
@@ -261,23 +495,687 @@ static int sendit(int timeout_ms)
 	return timeout_ms ? vibrate_on(timeout_ms) : vibrate_off();
 }
 
+/*
+ * a pattern is compiled into MagSweep effects by the caller, the worker
+ * then only has to fire each of them at its time. a run of segments
+ * becomes one effect: short steps heading towards the first long level
+ * are played as attack, equal levels are merged into the sustain, and
+ * short steps heading away from it before a pause are played as fade
+ */
+#define RAMP_MAX_MS 100
+
+struct vibra_pattern {
+	unsigned int count;
+	unsigned int loop;      /* first effect of the repeating part, count if none */
+	int32_t loopAt;         /* where the repeating part starts */
+	int32_t length;
+	struct vibra_effect effects[];
+};
+
+static int step_sign(const pisces_vibrator_segment_t *s)
+{
+	return (s[1].amplitude > s[0].amplitude) - (s[1].amplitude < s[0].amplitude);
+}
+
+/* number of short segments from s on stepping in the same direction */
+static unsigned int ramp_length(const pisces_vibrator_segment_t *s, unsigned int count)
+{
+	unsigned int n = 0;
+	int sign = count > 1 ? step_sign(s) : 0;
+
+	while (sign && n + 1 < count && s[n + 1].amplitude
+			&& s[n].duration_ms <= RAMP_MAX_MS && step_sign(s + n) == sign) {
+		n++;
+	}
+	return n;
+}
+
+static int32_t pattern_compile_run(const pisces_vibrator_segment_t *segments,
+		unsigned int count, int32_t at, struct vibra_pattern *p)
+{
+	unsigned int i = 0, n;
+
+	while (i < count) {
+		if (!segments[i].amplitude) {
+			at += segments[i++].duration_ms;
+			continue;
+		}
+
+		struct vibra_effect *e = &p->effects[p->count++];
+		memset(e, 0, sizeof(*e));
+		e->at = at;
+
+		n = ramp_length(segments + i, count - i);
+		if (n) {
+			e->attackLevel = segments[i].amplitude;
+			for (; n; n--, i++) {
+				e->attackTime += segments[i].duration_ms;
+			}
+			e->duration = e->attackTime;
+		}
+
+		e->level = segments[i].amplitude;
+		while (i < count && segments[i].amplitude == (uint32_t) e->level) {
+			e->duration += segments[i++].duration_ms;
+		}
+
+		/* a fade has to run into a pause or the end */
+		for (n = 0; i + n < count && segments[i + n].amplitude
+				&& segments[i + n].duration_ms <= RAMP_MAX_MS
+				&& step_sign(segments + i + n - 1) == step_sign(segments + i - 1); n++)
+			;
+		if (n && (i + n == count || !segments[i + n].amplitude)) {
+			e->fadeLevel = segments[i + n - 1].amplitude;
+			for (; n; n--, i++) {
+				e->fadeTime += segments[i].duration_ms;
+			}
+			e->duration += e->fadeTime;
+		}
+		at += e->duration;
+	}
+	return at;
+}
+
+static struct vibra_pattern *pattern_compile(const pisces_vibrator_segment_t *segments,
+		unsigned int count, int repeat)
+{
+	struct vibra_pattern *p = (struct vibra_pattern *) malloc(
+			sizeof(*p) + count * sizeof(p->effects[0]));
+	if (!p) {
+		return NULL;
+	}
+
+	/* effects never span the loop point */
+	unsigned int loop = repeat < 0 ? count : (unsigned int) repeat;
+	p->count = 0;
+	p->loopAt = pattern_compile_run(segments, loop, 0, p);
+	p->loop = p->count;
+	p->length = pattern_compile_run(segments + loop, count - loop, p->loopAt, p);
+	return p;
+}
+
+/*
+ * vibra_on/vibra_off only post a command word here and return, the worker
+ * thread owns devHandle and does all ImmVibe calls. a newer command
+ * replaces one the worker has not picked up yet, so an on that is
+ * followed by an off before it was sent never reaches immvibed at all
+ */
+#define CMD_NONE      0u
+#define CMD_ON        (1u << 30)
+#define CMD_OFF       (2u << 30)
+#define CMD_EFFECT    (3u << 30)
+#define CMD_TYPE_MASK (3u << 30)
+#define CMD_ARG_MAX   (~CMD_TYPE_MASK)
+/* an on with this "duration" picks up pendingPattern */
+#define CMD_PATTERN   (CMD_ON | CMD_ARG_MAX)
+#define CMD_QUIT      (CMD_EFFECT | CMD_ARG_MAX)
+
+static uint32_t mailbox = CMD_NONE;
+static struct vibra_pattern *pendingPattern;
+static pthread_t worker;
+static int workerStarted;
+
+/*
+ * the motor can't follow anything shorter than this, stopping an effect
+ * that ends within it anyway is just a wasted ImmVibe call
+ */
+#define ACTUATOR_RESPONSE_MS 10
+
+/* last effect ends here, an off arriving later needs no ImmVibe call */
+static int64_t vibratingUntil;
+
+/* pattern being played by the worker */
+static struct vibra_pattern *playing;
+static unsigned int playingNext;
+static int64_t playingStart;
+
+/*
+ * short clicks skip the IPC to immvibed and go straight to the kernel
+ * timed_output node, when there is one. the node has no strength, so
+ * they are always at full strength, and go through ImmVibe like any
+ * other effect when the user turned the intensity all the way down
+ */
+#define TIMED_OUTPUT_ENABLE "/sys/class/timed_output/vibrator/enable"
+#define DIRECT_MAX_PROPERTY "persist.vibrator.direct_max_ms"
+#define DIRECT_MAX_DEFAULT  40
+
+static int directFd = -1;
+static int directMaxMs;
+
+enum vibra_path {
+	PATH_IMMVIBE,
+	PATH_DIRECT,
+	PATH_COUNT,
+};
+
+/* from vibra_on to the motor being told, per path */
+struct path_stat {
+	uint32_t count;
+	uint32_t maxUs;
+	uint64_t totalUs;
+};
+
+static struct path_stat pathStats[PATH_COUNT];
+static int activePath = PATH_IMMVIBE;
+static int64_t postedAt;
+
+static void direct_init()
+{
+	directMaxMs = property_get_int32(DIRECT_MAX_PROPERTY, DIRECT_MAX_DEFAULT);
+	if (directMaxMs <= 0) {
+		return;
+	}
+
+	directFd = open(TIMED_OUTPUT_ENABLE, O_WRONLY | O_CLOEXEC);
+	if (directFd < 0) {
+		ALOGI("no %s, all effects go through ImmVibe", TIMED_OUTPUT_ENABLE);
+	} else {
+		ALOGI("effects shorter than %d ms go through %s", directMaxMs, TIMED_OUTPUT_ENABLE);
+	}
+}
+
+static int direct_use(int timeout_ms)
+{
+	return timeout_ms && timeout_ms < directMaxMs && directFd >= 0;
+}
+
+static int direct_send(int timeout_ms)
+{
+	char buf[16];
+	int len = snprintf(buf, sizeof(buf), "%d", timeout_ms);
+
+	if (pwrite(directFd, buf, len, 0) != len) {
+		ALOGE("write %s failed: %s", TIMED_OUTPUT_ENABLE, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+static void path_stat_add(int path, int64_t since)
+{
+	struct path_stat *stat = &pathStats[path];
+	uint32_t us = (uint32_t) (now_us() - since);
+
+	stat->count++;
+	stat->totalUs += us;
+	if (us > stat->maxUs) {
+		stat->maxUs = us;
+	}
+}
+
+/*
+ * effects authored in an IVT file are played with one indexed call.
+ * the library is loaded once at open, and ons of about the length of
+ * one of its single pulse effects play that effect instead of a MagSweep
+ */
+#define IVT_LIBRARY_PROPERTY "ro.vibrator.ivt_library"
+#define IVT_LIBRARY_DEFAULT  "/system/etc/pisces_effects.ivt"
+#define IVT_LIBRARY_MAX_SIZE 16384
+#define IVT_LOOKUP_MAX_MS    200
+
+struct ivt_effect {
+	const char *name;
+	int byDuration;         /* single pulse, stands in for a plain on */
+	VibeInt32 index;
+	VibeInt32 duration;
+};
+
+/* in PISCES_VIBRATOR_EFFECT_* order */
+static struct ivt_effect ivtEffects[PISCES_VIBRATOR_EFFECT_COUNT] = {
+	{ "click",        1, -1, 0 },
+	{ "double_click", 0, -1, 0 },
+	{ "tick",         1, -1, 0 },
+	{ "long_press",   1, -1, 0 },
+};
+
+static VibeUInt8 *ivtData;
+static int8_t ivtByDuration[IVT_LOOKUP_MAX_MS + 1];
+
+static VibeUInt8 *ivt_read(const char *path)
+{
+	struct stat st;
+	VibeUInt8 *data = NULL;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		ALOGI("no IVT effect library %s", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size <= 0 || st.st_size > IVT_LIBRARY_MAX_SIZE) {
+		ALOGE("bad IVT effect library %s", path);
+	} else if ((data = (VibeUInt8 *) malloc(st.st_size))
+			&& read(fd, data, st.st_size) != st.st_size) {
+		ALOGE("error reading IVT effect library %s", path);
+		free(data);
+		data = NULL;
+	}
+	close(fd);
+	return data;
+}
+
+static void ivt_init()
+{
+	char path[PROPERTY_VALUE_MAX];
+	int i, d, loaded = 0;
+
+	memset(ivtByDuration, -1, sizeof(ivtByDuration));
+	if (!ImmVibePlayIVTEffect || !ImmVibeGetIVTEffectCount
+			|| !ImmVibeGetIVTEffectDuration || !ImmVibeGetIVTEffectIndexFromName) {
+		return;
+	}
+
+	property_get(IVT_LIBRARY_PROPERTY, path, IVT_LIBRARY_DEFAULT);
+	if (!(ivtData = ivt_read(path))) {
+		return;
+	}
+	if (ImmVibeGetIVTEffectCount(ivtData) <= 0) {
+		ALOGE("no effects in IVT effect library %s", path);
+		free(ivtData);
+		ivtData = NULL;
+		return;
+	}
+
+	for (i = 0; i < PISCES_VIBRATOR_EFFECT_COUNT; i++) {
+		struct ivt_effect *e = &ivtEffects[i];
+		VibeInt32 duration;
+
+		if (VIBE_FAILED(ImmVibeGetIVTEffectIndexFromName(ivtData, e->name, &e->index))
+				|| VIBE_FAILED(ImmVibeGetIVTEffectDuration(ivtData, e->index, &duration))
+				|| duration <= 0) {
+			e->index = -1;
+			continue;
+		}
+		e->duration = duration;
+		loaded++;
+	}
+
+	/* nearest single pulse effect, if within a quarter of the duration */
+	for (d = 1; d <= IVT_LOOKUP_MAX_MS; d++) {
+		int best = -1, bestDiff = d / 4 + 5;
+
+		for (i = 0; i < PISCES_VIBRATOR_EFFECT_COUNT; i++) {
+			const struct ivt_effect *e = &ivtEffects[i];
+			int diff = abs(e->duration - d);
+
+			if (e->index >= 0 && e->byDuration && diff <= bestDiff) {
+				best = i;
+				bestDiff = diff;
+			}
+		}
+		ivtByDuration[d] = best;
+	}
+	ALOGI("loaded %d effects from IVT effect library %s", loaded, path);
+}
+
+static int ivt_lookup(int timeout_ms)
+{
+	return timeout_ms <= IVT_LOOKUP_MAX_MS ? ivtByDuration[timeout_ms] : -1;
+}
+
+/* VIBE_E_NOT_SUPPORTED if the effect could not follow the user intensity */
+static VibeStatus ivt_send(int effect)
+{
+	VibeInt32 effectHandle;
+	VibeStatus vs = vibrate_init();
+
+	if (VIBE_FAILED(vs)) {
+		return vs;
+	}
+	if (vibrate_scale() != VIBE_MAX_MAGNITUDE) {
+		return VIBE_E_NOT_SUPPORTED;
+	}
+
+	ALOGV("vibrate IVT effect %s", ivtEffects[effect].name);
+	vs = ImmVibePlayIVTEffect(devHandle, ivtData, ivtEffects[effect].index, &effectHandle);
+	if (VIBE_FAILED(vs)) {
+		ALOGE("ImmVibePlayIVTEffect failed, status=%d", (int) vs);
+		vibrate_failed();
+	}
+	return vs;
+}
+
+static void mailbox_wait(int64_t timeout_ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+	syscall(__NR_futex, &mailbox, FUTEX_WAIT_PRIVATE, CMD_NONE,
+			timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static void mailbox_post(uint32_t cmd)
+{
+	__atomic_store_n(&mailbox, cmd, __ATOMIC_RELEASE);
+	syscall(__NR_futex, &mailbox, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static int64_t pattern_deadline()
+{
+	return playingStart + (playingNext < playing->count
+			? playing->effects[playingNext].at : playing->length);
+}
+
+static void pattern_stop()
+{
+	free(playing);
+	playing = NULL;
+}
+
+/* fire everything that is due, loop or finish at the end */
+static void pattern_step(int64_t now)
+{
+	while (playing && pattern_deadline() <= now) {
+		if (playingNext < playing->count) {
+			const struct vibra_effect *e = &playing->effects[playingNext++];
+
+			if (VIBE_SUCCEEDED(vibrate_init()) && VIBE_SUCCEEDED(vibrate_play(e))) {
+				vibratingUntil = playingStart + e->at + e->duration;
+			}
+		} else if (playing->loopAt < playing->length) {
+			playingStart += playing->length - playing->loopAt;
+			playingNext = playing->loop;
+		} else {
+			pattern_stop();
+		}
+	}
+}
+
+static void vibrate_stop()
+{
+	if (activePath == PATH_DIRECT) {
+		direct_send(0);
+	} else {
+		sendit(0);
+	}
+	vibratingUntil = 0;
+}
+
+static void vibrate_command(uint32_t cmd)
+{
+	int64_t now = now_ms();
+	int timeout_ms = (int) (cmd & CMD_ARG_MAX);
+	int effect, path, rc;
+
+	/* anything new replaces the pattern */
+	pattern_stop();
+
+	if (cmd == CMD_PATTERN) {
+		playing = __atomic_exchange_n(&pendingPattern, NULL, __ATOMIC_ACQUIRE);
+		if (!playing) {
+			return;
+		}
+		if (vibratingUntil - now > ACTUATOR_RESPONSE_MS) {
+			vibrate_stop();
+		}
+		activePath = PATH_IMMVIBE;
+		playingNext = 0;
+		playingStart = now;
+		pattern_step(now);
+		return;
+	}
+
+	switch (cmd & CMD_TYPE_MASK) {
+	case CMD_ON:
+		/* an off superseded by this on still has to cut a longer effect */
+		if (vibratingUntil - now > timeout_ms + ACTUATOR_RESPONSE_MS) {
+			vibrate_stop();
+		}
+		path = PATH_IMMVIBE;
+		if (direct_use(timeout_ms) && vibrate_intensity() > VIBE_MIN_MAGNITUDE) {
+			path = PATH_DIRECT;
+			rc = direct_send(timeout_ms);
+		} else if ((effect = ivt_lookup(timeout_ms)) < 0
+				|| (rc = ivt_send(effect)) == VIBE_E_NOT_SUPPORTED) {
+			rc = sendit(timeout_ms);
+		} else {
+			timeout_ms = ivtEffects[effect].duration;
+		}
+		if (rc >= 0) {
+			path_stat_add(path, __atomic_load_n(&postedAt, __ATOMIC_RELAXED));
+			activePath = path;
+			vibratingUntil = now + timeout_ms;
+		} else {
+			/*
+			 * let through before immvibed went away, or as a direct click
+			 * before the intensity went to the minimum: dropped after all
+			 */
+			if (path == PATH_IMMVIBE
+					&& __atomic_load_n(&connState, __ATOMIC_ACQUIRE) == CONN_BACKOFF) {
+				stat_inc(&statDropped);
+			}
+			vibratingUntil = 0;
+		}
+		break;
+
+	case CMD_EFFECT:
+		effect = timeout_ms;
+		timeout_ms = ivtEffects[effect].duration;
+		if (vibratingUntil - now > ACTUATOR_RESPONSE_MS) {
+			vibrate_stop();
+		}
+		rc = ivt_send(effect);
+		if (rc == VIBE_E_NOT_SUPPORTED) {
+			rc = sendit(timeout_ms);
+		}
+		if (rc >= 0) {
+			activePath = PATH_IMMVIBE;
+			vibratingUntil = now + timeout_ms;
+		} else {
+			vibratingUntil = 0;
+		}
+		break;
+
+	case CMD_OFF:
+		if (vibratingUntil - now <= ACTUATOR_RESPONSE_MS) {
+			ALOGV("already stopped");
+			break;
+		}
+		if (activePath == PATH_IMMVIBE
+				&& __atomic_load_n(&connState, __ATOMIC_ACQUIRE) == CONN_BACKOFF) {
+			/* immvibed is gone and took its effects with it */
+			vibratingUntil = 0;
+			break;
+		}
+		vibrate_stop();
+		break;
+	}
+}
+
+static void *vibrate_worker(void *)
+{
+	for (;;) {
+		uint32_t cmd = __atomic_exchange_n(&mailbox, CMD_NONE, __ATOMIC_ACQUIRE);
+		if (cmd == CMD_NONE) {
+			int64_t deadline = playing ? pattern_deadline() : -1;
+			if (connState == CONN_BACKOFF && (deadline < 0 || retryAt < deadline)) {
+				deadline = retryAt;
+			}
+			if (deadline < 0) {
+				mailbox_wait(-1);
+				continue;
+			}
+
+			int64_t now = now_ms();
+			if (deadline > now) {
+				mailbox_wait(deadline - now);
+				continue;
+			}
+			if (connState == CONN_BACKOFF && retryAt <= now) {
+				/* reconnect in the background, before anyone asks */
+				vibrate_init();
+			}
+			if (playing) {
+				pattern_step(now);
+			}
+			continue;
+		}
+		if (cmd == CMD_QUIT) {
+			break;
+		}
+		vibrate_command(cmd);
+	}
+	pattern_stop();
+	return NULL;
+}
+
+/*
+ * nothing but direct clicks can be played while immvibed is unreachable,
+ * routed like vibrate_command does. offs are never dropped, the worker
+ * still has to stop a pattern
+ */
+static int vibrate_dropped(unsigned int timeout_ms)
+{
+	stat_inc(&statRequests);
+	if ((direct_use(timeout_ms) && !__atomic_load_n(&intensityMuted, __ATOMIC_RELAXED))
+			|| __atomic_load_n(&connState, __ATOMIC_ACQUIRE) != CONN_BACKOFF) {
+		return 0;
+	}
+	stat_inc(&statDropped);
+	return 1;
+}
+
 extern "C" {
 
-static int vibra_on(vibrator_device_t* vibradev __unused, unsigned int timeout_ms)
+static int vibra_off(vibrator_device_t* vibradev __unused)
 {
+    stat_inc(&statRequests);
+    mailbox_post(CMD_OFF);
+    return 0;
+}
+
+static int vibra_on(vibrator_device_t* vibradev, unsigned int timeout_ms)
+{
+    if (!timeout_ms) {
+        return vibra_off(vibradev);
+    }
     /* constant on, up to maximum allowed time */
-    return sendit(timeout_ms);
+    if (timeout_ms >= CMD_ARG_MAX) {
+        timeout_ms = CMD_ARG_MAX - 1;
+    }
+    if (vibrate_dropped(timeout_ms)) {
+        return 0;
+    }
+
+    __atomic_store_n(&postedAt, now_us(), __ATOMIC_RELAXED);
+    mailbox_post(CMD_ON | timeout_ms);
+    return 0;
 }
 
-static int vibra_off(vibrator_device_t* vibradev __unused)
+static int vibra_play_pattern(pisces_vibrator_device_t* vibradev __unused,
+        const pisces_vibrator_segment_t* segments, unsigned int count, int repeat)
+{
+    unsigned int i;
+    uint32_t length = 0;
+
+    if (!segments || !count || count > PISCES_VIBRATOR_MAX_SEGMENTS
+            || repeat >= (int) count) {
+        return -EINVAL;
+    }
+    for (i = 0; i < count; i++) {
+        if (segments[i].amplitude > PISCES_VIBRATOR_MAX_AMPLITUDE
+                || segments[i].duration_ms > CMD_ARG_MAX / PISCES_VIBRATOR_MAX_SEGMENTS) {
+            return -EINVAL;
+        }
+        if ((int) i >= repeat) {
+            length += segments[i].duration_ms;
+        }
+    }
+    if (repeat >= 0 && !length) {
+        return -EINVAL;
+    }
+    if (vibrate_dropped(0)) {
+        return -EAGAIN;
+    }
+
+    struct vibra_pattern *p = pattern_compile(segments, count, repeat);
+    if (!p) {
+        return -ENOMEM;
+    }
+
+    free(__atomic_exchange_n(&pendingPattern, p, __ATOMIC_RELEASE));
+    mailbox_post(CMD_PATTERN);
+    return 0;
+}
+
+static int vibra_play_effect(pisces_vibrator_device_t* vibradev __unused, int effect)
 {
-    return sendit(0);
+    if (effect < 0 || effect >= PISCES_VIBRATOR_EFFECT_COUNT) {
+        return -EINVAL;
+    }
+    if (!ivtData || ivtEffects[effect].index < 0) {
+        return -ENOTSUP;
+    }
+    if (vibrate_dropped(0)) {
+        return -EAGAIN;
+    }
+
+    mailbox_post(CMD_EFFECT | effect);
+    return 0;
+}
+
+static int vibra_dump(pisces_vibrator_device_t* vibradev __unused, int fd)
+{
+    static const char *const states[] = { "down", "up", "backoff" };
+    int state = __atomic_load_n(&connState, __ATOMIC_ACQUIRE);
+
+    dprintf(fd, "ImmVibe connection: %s\n", states[state]);
+    if (state == CONN_BACKOFF) {
+        dprintf(fd, "  retry in %lld ms\n", (long long) (retryAt - now_ms()));
+    }
+    dprintf(fd, "  requests: %u\n", __atomic_load_n(&statRequests, __ATOMIC_RELAXED));
+    dprintf(fd, "  dropped: %u\n", __atomic_load_n(&statDropped, __ATOMIC_RELAXED));
+    dprintf(fd, "  failures: %u\n", __atomic_load_n(&statFailures, __ATOMIC_RELAXED));
+    dprintf(fd, "  reconnects: %u\n", __atomic_load_n(&statReconnects, __ATOMIC_RELAXED));
+
+    if (!ivtData) {
+        dprintf(fd, "IVT effect library: not loaded\n");
+    } else {
+        dprintf(fd, "IVT effect library:\n");
+        for (int i = 0; i < PISCES_VIBRATOR_EFFECT_COUNT; i++) {
+            const struct ivt_effect *e = &ivtEffects[i];
+            if (e->index >= 0) {
+                dprintf(fd, "  %s: index %d, %d ms\n", e->name, (int) e->index, (int) e->duration);
+            }
+        }
+        dprintf(fd, "  device strength: %s\n", strengthUnsupported ? "unsupported" : "supported");
+    }
+
+    static const char *const paths[] = { "immvibe", "direct" };
+    for (int i = 0; i < PATH_COUNT; i++) {
+        const struct path_stat *stat = &pathStats[i];
+        if (i == PATH_DIRECT && directFd < 0) {
+            dprintf(fd, "on-to-motor latency %s: no %s\n", paths[i], TIMED_OUTPUT_ENABLE);
+            continue;
+        }
+        dprintf(fd, "on-to-motor latency %s: %u effects, avg %llu us, max %u us\n",
+                paths[i], stat->count,
+                stat->count ? (unsigned long long) (stat->totalUs / stat->count) : 0ULL,
+                stat->maxUs);
+    }
+    if (directFd >= 0) {
+        dprintf(fd, "direct effects ignore the intensity, none are played at %d\n",
+                VIBE_MIN_MAGNITUDE);
+    }
+    return 0;
 }
 
 static int vibra_close(hw_device_t *device)
 {
-    free(device);
+    if (workerStarted) {
+        mailbox_post(CMD_QUIT);
+        pthread_join(worker, NULL);
+        workerStarted = 0;
+    }
+    free(__atomic_exchange_n(&pendingPattern, NULL, __ATOMIC_ACQUIRE));
+    delete (pisces_vibrator_device_t *) device;
     vibrate_terminate();
+    if (directFd >= 0) {
+        close(directFd);
+        directFd = -1;
+    }
+    free(ivtData);
+    ivtData = NULL;
     return 0;
 }
 
@@ -285,24 +1183,43 @@ static int vibra_close(hw_device_t *device)
 
 static int vibra_open(const hw_module_t* module, const char* id __unused,
                       hw_device_t** device __unused) {
-    vibrator_device_t *vibradev = new vibrator_device_t;
+    if (workerStarted) {
+        ALOGE("vibrator device is already open");
+        return -EBUSY;
+    }
+
+    pisces_vibrator_device_t *vibradev = new pisces_vibrator_device_t;
 
     if (!vibradev) {
         ALOGE("Can not allocate memory for the vibrator device");
         return -ENOMEM;
     }
 
-    vibradev->common.tag = HARDWARE_DEVICE_TAG;
-    vibradev->common.module = (hw_module_t *) module;
-    vibradev->common.version = HARDWARE_DEVICE_API_VERSION(1,0);
-    vibradev->common.close = vibra_close;
+    vibradev->common.common.tag = HARDWARE_DEVICE_TAG;
+    vibradev->common.common.module = (hw_module_t *) module;
+    vibradev->common.common.version = PISCES_VIBRATOR_DEVICE_API_VERSION;
+    vibradev->common.common.close = vibra_close;
 
-    vibradev->vibrator_on = vibra_on;
-    vibradev->vibrator_off = vibra_off;
-
-    *device = (hw_device_t *) vibradev;
+    vibradev->common.vibrator_on = vibra_on;
+    vibradev->common.vibrator_off = vibra_off;
+    vibradev->play_pattern = vibra_play_pattern;
+    vibradev->play_effect = vibra_play_effect;
+    vibradev->dump = vibra_dump;
 
+    direct_init();
     vibrate_init();
+    ivt_init();
+
+    __atomic_store_n(&mailbox, CMD_NONE, __ATOMIC_RELAXED);
+    if (pthread_create(&worker, NULL, vibrate_worker, NULL)) {
+        ALOGE("Can not create vibrator worker thread");
+        delete vibradev;
+        vibrate_terminate();
+        return -ENOMEM;
+    }
+    workerStarted = 1;
+
+    *device = (hw_device_t *) vibradev;
 
     return 0;
 }